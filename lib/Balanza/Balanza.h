@@ -0,0 +1,75 @@
+// Curva de calibración multipunto y modelo de deriva del cero (ver BALANZA:
+// TARA Y DERIVA en main.cpp). Sin Arduino ni HX711 para poder probarlo en el
+// host (pio test -e native).
+#pragma once
+#include <stdint.h>
+#include <math.h>
+
+struct MuestraTara {
+  uint32_t tSeg;    // segundos desde el arranque al tarar (base del modelo)
+  uint32_t epoch;   // para métricas; 0 si no había hora
+  int32_t offset;   // cuentas crudas del cero
+};
+
+struct PuntoCalibracion {
+  float crudo;      // cuentas sobre el cero
+  float kg;
+};
+
+// Convierte cuentas sobre el cero a kg. Con puntos (ordenados por crudo) la
+// curva pasa por el origen y se interpola por tramos; por debajo del primero
+// y más allá del último se extrapola con la pendiente del tramo extremo. Sin
+// puntos se usa el factor lineal.
+inline float balanzaKgDesdeCrudo(const PuntoCalibracion* puntos, uint8_t n, float crudo, float factor) {
+  if (n == 0) return crudo / factor;
+  float c0 = 0.0, k0 = 0.0;
+  for (uint8_t i = 0; i < n; i++) {
+    const PuntoCalibracion &p = puntos[i];
+    if (crudo <= p.crudo || i == n - 1) {
+      if (p.crudo == c0) return p.kg;
+      return k0 + (crudo - c0) * (p.kg - k0) / (p.crudo - c0);
+    }
+    c0 = p.crudo;
+    k0 = p.kg;
+  }
+  return 0.0;
+}
+
+// Inserta un punto manteniendo el orden, o reemplaza el que tenga un crudo a
+// menos del 1%. false si el punto no es válido o la tabla está llena.
+inline bool balanzaAgregarPunto(PuntoCalibracion* puntos, uint8_t &n, uint8_t max, float crudo, float kg) {
+  if (crudo <= 0.0 || kg <= 0.0) return false;
+  uint8_t i = 0;
+  while (i < n && puntos[i].crudo < crudo) i++;
+  bool reemplaza = (i < n && fabsf(puntos[i].crudo - crudo) < crudo * 0.01f);
+  if (!reemplaza && i > 0 && fabsf(puntos[i - 1].crudo - crudo) < crudo * 0.01f) {
+    i--;
+    reemplaza = true;
+  }
+  if (!reemplaza) {
+    if (n >= max) return false;
+    for (uint8_t j = n; j > i; j--) puntos[j] = puntos[j - 1];
+    n++;
+  }
+  puntos[i].crudo = crudo;
+  puntos[i].kg = kg;
+  return true;
+}
+
+// Pendiente de deriva del cero (cuentas/s) por mínimos cuadrados sobre el
+// historial circular 'hist' de capacidad 'cap'. 0 con menos de dos muestras o
+// si todas tienen el mismo tiempo.
+inline float balanzaPendienteDeriva(const MuestraTara* hist, uint8_t head, uint8_t count, uint8_t cap) {
+  if (count < 2) return 0.0;
+  const MuestraTara &base = hist[head];
+  double st = 0, so = 0, stt = 0, sto = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    const MuestraTara &m = hist[(head + i) % cap];
+    double t = (double)(uint32_t)(m.tSeg - base.tSeg);
+    double o = (double)(m.offset - base.offset);
+    st += t; so += o; stt += t * t; sto += t * o;
+  }
+  double den = count * stt - st * st;
+  if (den <= 0) return 0.0;
+  return (float)((count * sto - st * so) / den);
+}
@@ -0,0 +1,131 @@
+// Cálculos del lazo de dosificación continua (ver Dosificación continua en
+// main.cpp): filtro de peso y caudal, apertura pedida, punto de corte y
+// aprendizaje de caudal por apertura y latencia de caída. Sin Arduino para
+// poder probarlos en el host (pio test -e native).
+#pragma once
+#include <stdint.h>
+
+const float CONT_TAU_S = 1.5;            // tiempo deseado para cubrir lo que falta
+const float CONT_APERTURA_MIN = 0.15;    // por debajo casi no fluye
+const float CONT_ALFA_PESO = 0.4;        // suavizado del peso
+const float CONT_ALFA_CAUDAL = 0.3;      // suavizado del caudal
+const int CONT_PASO_MAX_GRADOS = 6;      // paso máximo del servo por lectura
+const float MARGEN_CORTE_DEFECTO_KG = 0.002;   // default de margen_corte_kg
+const int PUERTA1_CERRADA = 90;
+const int PUERTA1_ABIERTA = 45;
+const unsigned PUERTA1_PASO_MS = 10;     // rampa de los pulsos: 1° cada 10 ms
+#define CONT_HISTORIA 32                 // aperturas recordadas por dosis (3.2 s a 10 SPS)
+// Retraso medio en lecturas de los filtros de peso y caudal: (1 - alfa) / alfa cada uno
+const int CONT_RETRASO_FILTROS = (int)((1 - CONT_ALFA_PESO) / CONT_ALFA_PESO +
+                                       (1 - CONT_ALFA_CAUDAL) / CONT_ALFA_CAUDAL + 0.5f);
+
+struct LazoContinuo {
+  float pesoFiltrado;   // kg
+  float caudal;         // kg/s, nunca negativo
+};
+
+inline void lazoIniciar(LazoContinuo &l, float pesoInicial) {
+  l.pesoFiltrado = pesoInicial;
+  l.caudal = 0.0;
+}
+
+// Incorpora una lectura tomada 'dtS' segundos después de la anterior
+inline void lazoMedir(LazoContinuo &l, float peso, float dtS, float alfaPeso, float alfaCaudal) {
+  float previo = l.pesoFiltrado;
+  l.pesoFiltrado += alfaPeso * (peso - l.pesoFiltrado);
+  if (dtS > 0) l.caudal += alfaCaudal * ((l.pesoFiltrado - previo) / dtS - l.caudal);
+  if (l.caudal < 0) l.caudal = 0;
+}
+
+// Cortar cuando lo que falta ya está en el aire: caudal * latencia de caída
+inline bool lazoDebeCortar(const LazoContinuo &l, float objetivo, float latenciaS, float margenKg) {
+  return objetivo - l.pesoFiltrado <= l.caudal * latenciaS + margenKg;
+}
+
+// Apertura (0..1) para cubrir lo que falta en 'tauS' con el caudal aprendido
+inline float lazoApertura(const LazoContinuo &l, float objetivo, float tauS,
+                          float caudalPorApertura, float aperturaMin) {
+  float apertura = ((objetivo - l.pesoFiltrado) / tauS) / caudalPorApertura;
+  if (apertura < aperturaMin) apertura = aperturaMin;
+  if (apertura > 1.0f) apertura = 1.0f;
+  return apertura;
+}
+
+// Aprende el caudal con la puerta totalmente abierta solo cuando la puerta
+// estaba realmente abierta y hubo flujo medible
+inline float aprenderCaudalPorApertura(float actual, float caudal, float aperturaReal, float aperturaMin) {
+  if (aperturaReal < aperturaMin || caudal <= 0.0005f) return actual;
+  return actual + 0.2f * (caudal / aperturaReal - actual);
+}
+
+// Latencia observada = masa que siguió cayendo tras el corte / caudal al
+// cortar. Valores fuera de 50 ms..2 s son ruido (o un corte sin flujo) y se
+// ignoran.
+inline float corregirLatencia(float actualS, float pesoFinal, float pesoAlCorte, float caudalAlCorte) {
+  if (caudalAlCorte <= 0.001f) return actualS;
+  float latencia = (pesoFinal - pesoAlCorte) / caudalAlCorte;
+  if (latencia <= 0.05f || latencia >= 2.0f) return actualS;
+  return actualS + 0.3f * (latencia - actualS);
+}
+
+// 90° cerrada, 45° abierta (mismos extremos que abrirPuerta1Lento)
+inline int anguloPuerta1(float apertura) {
+  return PUERTA1_CERRADA - (int)(apertura * (PUERTA1_CERRADA - PUERTA1_ABIERTA) + 0.5f);
+}
+
+inline float aperturaPuerta1(int angulo) {
+  return (PUERTA1_CERRADA - angulo) / (float)(PUERTA1_CERRADA - PUERTA1_ABIERTA);
+}
+
+// Una dosis continua paso a paso, en el orden de dosificarContinuo():
+// dosisDebeCortar -> dosisAngulo (mover el servo) -> lectura -> dosisMedir.
+// La misma secuencia corre en el equipo, en la tolva simulada y al reproducir
+// una traza capturada.
+struct DosisContinua {
+  LazoContinuo lazo;
+  float objetivo;
+  int angulo;             // último ángulo pedido a puerta 1
+  float pesoAlCorte;      // últimos valores del lazo, para corregir la latencia
+  float caudalAlCorte;
+  float aperturas[CONT_HISTORIA];   // apertura en cada lectura, la más nueva en 'lecturas'
+  uint16_t lecturas;
+};
+
+inline void dosisIniciar(DosisContinua &d, float objetivo, float pesoInicial) {
+  lazoIniciar(d.lazo, pesoInicial);
+  d.objetivo = objetivo;
+  d.angulo = PUERTA1_CERRADA;
+  d.pesoAlCorte = pesoInicial;
+  d.caudalAlCorte = 0.0;
+  d.lecturas = 0;
+}
+
+inline bool dosisDebeCortar(const DosisContinua &d, float latenciaS, float margenKg) {
+  return lazoDebeCortar(d.lazo, d.objetivo, latenciaS, margenKg);
+}
+
+// Próximo ángulo de puerta 1, sin pasos de más de CONT_PASO_MAX_GRADOS
+inline int dosisAngulo(DosisContinua &d, float caudalPorApertura) {
+  float apertura = lazoApertura(d.lazo, d.objetivo, CONT_TAU_S, caudalPorApertura, CONT_APERTURA_MIN);
+  int nuevo = anguloPuerta1(apertura);
+  if (nuevo < d.angulo - CONT_PASO_MAX_GRADOS) nuevo = d.angulo - CONT_PASO_MAX_GRADOS;
+  if (nuevo > d.angulo + CONT_PASO_MAX_GRADOS) nuevo = d.angulo + CONT_PASO_MAX_GRADOS;
+  d.angulo = nuevo;
+  return nuevo;
+}
+
+// Incorpora la lectura y devuelve el caudal por apertura aprendido. El caudal
+// filtrado de ahora salió de la puerta 'latenciaS' más el retraso de los
+// filtros atrás: se divide por la apertura de entonces, no por la actual
+// (con la puerta cerrándose, la actual sobreestima el caudal por apertura).
+inline float dosisMedir(DosisContinua &d, float peso, float dtS, float caudalPorApertura, float latenciaS) {
+  lazoMedir(d.lazo, peso, dtS, CONT_ALFA_PESO, CONT_ALFA_CAUDAL);
+  d.pesoAlCorte = d.lazo.pesoFiltrado;
+  d.caudalAlCorte = d.lazo.caudal;
+  d.aperturas[d.lecturas % CONT_HISTORIA] = aperturaPuerta1(d.angulo);
+  d.lecturas++;
+  int atras = (dtS > 0 ? (int)(latenciaS / dtS + 0.5f) : 0) + CONT_RETRASO_FILTROS;
+  if (atras >= d.lecturas || atras >= CONT_HISTORIA) return caudalPorApertura;
+  float apertura = d.aperturas[(d.lecturas - 1 - atras) % CONT_HISTORIA];
+  return aprenderCaudalPorApertura(caudalPorApertura, d.lazo.caudal, apertura, CONT_APERTURA_MIN);
+}
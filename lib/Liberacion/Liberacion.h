@@ -0,0 +1,72 @@
+// Decisión de cierre de puerta 2 durante la liberación (ver atenderLiberacion
+// en main.cpp): promedio móvil del peso de la cámara, vacío sostenido y tope.
+// Sin Arduino ni HX711 para poder probarla en el host (pio test -e native).
+#pragma once
+#include <stdint.h>
+
+#define LIB_MUESTRAS 3                            // lecturas promediadas durante la liberación
+const uint32_t LIB_MIN_ABIERTA_MS = 300;          // recorrido del servo antes de mirar el peso
+const uint32_t LIB_VACIO_ESTABLE_MS = 250;        // tiempo seguido bajo el umbral para cerrar
+const uint32_t TIEMPO_CIERRE_PUERTA2_MS = 600;    // recorrido del servo al cerrar
+
+enum CierreLiberacion {
+  LIB_SEGUIR,         // puerta 2 sigue abierta
+  LIB_CIERRE_VACIA,   // cámara vacía durante LIB_VACIO_ESTABLE_MS
+  LIB_CIERRE_TOPE     // se llegó al tope; ver numMuestras y pesoKg para saber si hubo atasco
+};
+
+struct Liberacion {
+  uint32_t tAbierta;       // millis() al abrir puerta 2
+  bool vacia;              // la última lectura estaba bajo el umbral
+  uint32_t tVacioDesde;
+  float pesoKg;            // promedio de las últimas LIB_MUESTRAS
+  float muestras[LIB_MUESTRAS];
+  uint8_t numMuestras;     // 0 = el HX711 todavía no dio ninguna lectura
+  uint8_t proxima;
+};
+
+inline void liberacionIniciar(Liberacion &l, uint32_t ahora) {
+  l.tAbierta = ahora;
+  l.vacia = false;
+  l.tVacioDesde = 0;
+  l.pesoKg = 0.0;
+  l.numMuestras = 0;
+  l.proxima = 0;
+}
+
+// Antes de LIB_MIN_ABIERTA_MS la puerta todavía se mueve y el peso no dice nada
+inline bool liberacionMideAhora(const Liberacion &l, uint32_t ahora) {
+  return ahora - l.tAbierta >= LIB_MIN_ABIERTA_MS;
+}
+
+// Incorpora una lectura: un golpe de la puerta no decide solo
+inline void liberacionMuestra(Liberacion &l, float kg, uint32_t ahora, float umbralVacioKg) {
+  l.muestras[l.proxima] = kg;
+  l.proxima = (l.proxima + 1) % LIB_MUESTRAS;
+  if (l.numMuestras < LIB_MUESTRAS) l.numMuestras++;
+  float suma = 0.0;
+  for (uint8_t i = 0; i < l.numMuestras; i++) suma += l.muestras[i];
+  l.pesoKg = suma / l.numMuestras;
+  if (l.pesoKg > umbralVacioKg) {
+    l.vacia = false;
+  } else if (!l.vacia) {
+    l.vacia = true;
+    l.tVacioDesde = ahora;
+  }
+}
+
+inline CierreLiberacion liberacionDecidir(const Liberacion &l, uint32_t ahora, uint32_t topeMs) {
+  if (l.vacia && ahora - l.tVacioDesde >= LIB_VACIO_ESTABLE_MS) return LIB_CIERRE_VACIA;
+  if (ahora - l.tAbierta >= topeMs) return LIB_CIERRE_TOPE;
+  return LIB_SEGUIR;
+}
+
+// Al tope con comida en la cámara: atasco. Sin lecturas el peso es desconocido.
+inline bool liberacionAtascada(const Liberacion &l, float umbralVacioKg) {
+  return l.numMuestras > 0 && l.pesoKg > umbralVacioKg;
+}
+
+// Solo se vio la cámara vacía si hubo lecturas y quedaron bajo el umbral
+inline bool liberacionVioVacia(const Liberacion &l, float umbralVacioKg) {
+  return l.numMuestras > 0 && l.pesoKg <= umbralVacioKg;
+}
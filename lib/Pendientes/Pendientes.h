@@ -0,0 +1,153 @@
+// Deduplicación de lecturas RFID y cola de mascotas pendientes (ver RFID
+// MULTI-TAG en main.cpp). Sin Arduino para poder probarla en el host
+// (pio test -e native); los tiempos son millis() de 32 bits y toleran el
+// desborde.
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#define PENDIENTES_UID_SIZE 4
+
+const uint32_t RFID_VISTO_TTL_MS = 3000;    // ignora relecturas dentro de este lapso
+const uint32_t PENDIENTE_TTL_MS = 30000;    // descarta pendientes que no se atendieron
+
+// Base de las entradas del caché de vistos; main.cpp la extiende con el
+// estado de rechazos agrupados.
+struct EntradaVisto {
+  uint8_t uid[PENDIENTES_UID_SIZE];
+  uint32_t tVisto;
+  bool usado;
+};
+
+template <class T, uint8_t N>
+T* buscarEnVistos(T (&cache)[N], const uint8_t* uid) {
+  for (uint8_t i = 0; i < N; i++) {
+    if (cache[i].usado && memcmp(cache[i].uid, uid, PENDIENTES_UID_SIZE) == 0) return &cache[i];
+  }
+  return nullptr;
+}
+
+// Devuelve la entrada del UID, creándola sobre una libre o la vista hace más
+// tiempo. 'alDesalojar' recibe la entrada pisada antes de limpiarla. Una
+// entrada nueva no cuenta como vista (tVisto = ahora - ttl).
+template <class T, uint8_t N>
+T& obtenerEnVistos(T (&cache)[N], const uint8_t* uid, uint32_t ahora, uint32_t ttl,
+                   void (*alDesalojar)(T&)) {
+  T* existente = buscarEnVistos(cache, uid);
+  if (existente) return *existente;
+
+  uint8_t victima = 0;
+  for (uint8_t i = 1; i < N; i++) {
+    if (!cache[victima].usado) break;
+    if (!cache[i].usado || (int32_t)(cache[i].tVisto - cache[victima].tVisto) < 0) victima = i;
+  }
+  T &c = cache[victima];
+  if (c.usado && alDesalojar) alDesalojar(c);
+  memset(&c, 0, sizeof(c));
+  memcpy(c.uid, uid, PENDIENTES_UID_SIZE);
+  c.usado = true;
+  c.tVisto = ahora - ttl;
+  return c;
+}
+
+// true si la entrada se vio hace menos de 'ttl'; si no, la marca como vista ahora
+inline bool vistoReciente(EntradaVisto &c, uint32_t ahora, uint32_t ttl) {
+  if (ahora - c.tVisto < ttl) return true;
+  c.tVisto = ahora;
+  return false;
+}
+
+struct Pendiente {
+  uint8_t uid[PENDIENTES_UID_SIZE];
+  uint32_t tLlegada;
+};
+
+template <uint8_t N>
+struct ColaPendientes {
+  Pendiente items[N];
+  uint8_t n = 0;
+
+  bool contiene(const uint8_t* uid) const {
+    for (uint8_t i = 0; i < n; i++) {
+      if (memcmp(items[i].uid, uid, PENDIENTES_UID_SIZE) == 0) return true;
+    }
+    return false;
+  }
+
+  // false si la cola está llena
+  bool agregar(const uint8_t* uid, uint32_t ahora) {
+    if (n >= N) return false;
+    memcpy(items[n].uid, uid, PENDIENTES_UID_SIZE);
+    items[n].tLlegada = ahora;
+    n++;
+    return true;
+  }
+
+  // Descarta las que esperan hace más de 'ttl'
+  void purgar(uint32_t ahora, uint32_t ttl) {
+    for (uint8_t i = 0; i < n; ) {
+      if (ahora - items[i].tLlegada > ttl) {
+        items[i] = items[--n];
+      } else {
+        i++;
+      }
+    }
+  }
+
+  // Saca la de mayor prioridad(pendiente); a igual prioridad, la más antigua
+  template <class F>
+  bool tomar(F prioridad, uint8_t* uidOut) {
+    if (n == 0) return false;
+    int mejor = -1;
+    uint8_t mejorPrio = 0;
+    for (uint8_t i = 0; i < n; i++) {
+      uint8_t prio = prioridad(items[i]);
+      if (mejor < 0 || prio > mejorPrio ||
+          (prio == mejorPrio && (int32_t)(items[i].tLlegada - items[mejor].tLlegada) < 0)) {
+        mejor = i;
+        mejorPrio = prio;
+      }
+    }
+    memcpy(uidOut, items[mejor].uid, PENDIENTES_UID_SIZE);
+    for (uint8_t i = mejor; i + 1 < n; i++) items[i] = items[i + 1];
+    n--;
+    return true;
+  }
+};
+
+enum ResultadoTarjeta {
+  TARJETA_AGREGADA,
+  TARJETA_YA_PENDIENTE,   // ya espera en la cola
+  TARJETA_REBOTE,         // vista hace menos de RFID_VISTO_TTL_MS
+  TARJETA_COLA_LLENA
+};
+
+// Una lectura del lector: la que ya espera en la cola y los rebotes del mismo
+// tag se descartan; si no, pasa a la cola. 'obtener(uid)' devuelve la entrada
+// del caché de vistos (la crea si hace falta).
+template <uint8_t N, class F>
+ResultadoTarjeta encolarTarjeta(ColaPendientes<N> &cola, const uint8_t* uid, uint32_t ahora, F obtener) {
+  if (cola.contiene(uid)) return TARJETA_YA_PENDIENTE;
+  if (vistoReciente(obtener(uid), ahora, RFID_VISTO_TTL_MS)) return TARJETA_REBOTE;
+  if (!cola.agregar(uid, ahora)) return TARJETA_COLA_LLENA;
+  return TARJETA_AGREGADA;
+}
+
+// Enumera las tarjetas del campo con un lector ISO14443A: REQA solo despierta
+// las que están en IDLE, la anticolisión del Select elige una y HLTA la deja
+// en HALT hasta que salga del campo. 'Lector' necesita nuevaTarjeta() (REQA),
+// leerUid() (Select), uid(), uidSize(), detener() (HLTA) y finalizar().
+// Devuelve cuántas respondieron.
+template <class Lector, class F>
+uint8_t escanearLector(Lector &lector, uint8_t max, F alLeer) {
+  uint8_t leidas = 0;
+  while (leidas < max) {
+    if (!lector.nuevaTarjeta()) break;
+    if (!lector.leerUid()) break;   // anticolisión: selecciona una sola
+    alLeer(lector.uid(), lector.uidSize());
+    lector.detener();
+    leidas++;
+  }
+  if (leidas > 0) lector.finalizar();
+  return leidas;
+}
@@ -0,0 +1,40 @@
+// Aritmética del reloj de pared (ver RELOJ en main.cpp). Sin Arduino ni
+// ESP-IDF para poder probarla en el host (pio test -e native).
+#pragma once
+#include <stdint.h>
+
+#define RELOJ_SEGUNDOS_DIA 86400UL
+
+// Epoch UTC a partir de un ancla (epoch, microsegundos de esp_timer) y el
+// esp_timer actual; los segundos parciales se truncan
+inline uint32_t relojEpochDesdeAncla(uint32_t anclaEpoch, int64_t anclaUs, int64_t ahoraUs) {
+  return anclaEpoch + (uint32_t)((ahoraUs - anclaUs) / 1000000);
+}
+
+// Hora local = UTC + offset de zona + offset de horario de verano
+inline uint32_t relojALocal(uint32_t epochUtc, int32_t gmtOffsetS, int32_t dstOffsetS) {
+  return epochUtc + (uint32_t)(gmtOffsetS + dstOffsetS);
+}
+
+// Número de día local desde 1970
+inline int32_t relojDiaLocal(uint32_t epochLocal) {
+  return (int32_t)(epochLocal / RELOJ_SEGUNDOS_DIA);
+}
+
+// Minutos desde la medianoche local (0..1439)
+inline uint16_t relojMinutoDelDia(uint32_t epochLocal) {
+  return (uint16_t)((epochLocal % RELOJ_SEGUNDOS_DIA) / 60);
+}
+
+// true (y actualiza 'ultimoDia') si 'dia' es válido y distinto del último
+// visto: ahí se dispara el callback de cambio de día. dia < 0 = sin hora.
+inline bool relojCambioDeDia(int32_t dia, int32_t &ultimoDia) {
+  if (dia < 0 || dia == ultimoDia) return false;
+  ultimoDia = dia;
+  return true;
+}
+
+// Avisa a 'alCambiarDia' (si hay) la primera vez que se ve cada día local
+inline void relojNotificarDia(int32_t dia, int32_t &ultimoDia, void (*alCambiarDia)(int32_t)) {
+  if (relojCambioDeDia(dia, ultimoDia) && alCambiarDia) alCambiarDia(ultimoDia);
+}
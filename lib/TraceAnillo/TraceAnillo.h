@@ -0,0 +1,149 @@
+// Anillo de registros de traza sobre una región de flash que se borra por
+// sectores (ver TRAZAS en main.cpp). 'Flash' solo necesita tamano(), leer(),
+// escribir() y borrar(): en el equipo es la partición "trace", en el host
+// (pio test -e native) un arreglo en RAM.
+#pragma once
+#include <stdint.h>
+
+#define TRACE_SECTOR 4096
+#define TRACE_MARCA 0x7A5C
+#define TRACE_RAM 512   // registros en espera de volcarse (8 KB)
+
+enum TraceTipo {
+  TR_ARRANQUE,   // valor = configVersion
+  TR_HX711,      // aux = TraceHx711, valor = cuentas crudas sobre el cero (int32)
+  TR_RFID,       // valor = UID empaquetado (uid[0] en el byte alto)
+  TR_SERVO,      // aux = puerta (1/2), valor = ángulo final
+  TR_ESTADO,     // aux = EstadoSistema nuevo, valor = estado anterior
+  TR_CONFIG,     // aux = TraceAccion, valor = UID empaquetado si aplica
+  TR_DOSIS       // aux = TraceDosis, valor = bits del float; al iniciar una dosis continua
+};
+
+// Dónde se tomó cada lectura del HX711
+enum TraceHx711 {
+  TRH_PROMEDIO,      // leerPesoKg(): get_value(10)
+  TRH_CONTINUO,      // lazo continuo: get_value(1), t_ms = instante usado para el caudal
+  TRH_LIBERACION,    // con puerta 2 abierta: get_value(1)
+  TRH_CORTE,         // tras cerrar el continuo, para corregir la latencia: get_value(5)
+  TRH_TARA,          // read_average() crudo, con el cero incluido
+  TRH_CALIBRACION    // punto de calibración: get_value(10)
+};
+
+// Estado del lazo continuo al arrancar, para reproducirlo desde la traza
+enum TraceDosis {
+  TRD_OBJETIVO,      // kg
+  TRD_PESO_INICIAL,  // kg; t_ms = inicio de la dosis
+  TRD_LATENCIA,      // s
+  TRD_CAUDAL         // kg/s con la puerta totalmente abierta
+};
+
+struct TraceRegistro {
+  uint32_t seq;
+  uint32_t t_ms;
+  uint8_t tipo;
+  uint8_t aux;
+  uint16_t marca;
+  uint32_t valor;
+};
+
+// Registros fijos de 16 bytes; al entrar a un sector nuevo se borra completo,
+// así el sector más viejo se recicla. registrar() solo copia a un buffer en
+// RAM: el borrado de un sector tarda decenas de ms y no puede caer dentro de
+// los lazos de servo y balanza. volcar() pasa el buffer a flash con el equipo
+// ocioso; con el buffer lleno los registros nuevos se cuentan en 'perdidos'.
+template <class Flash, uint16_t RAM = TRACE_RAM>
+struct AnilloTrazas {
+  Flash &flash;
+  uint32_t seq = 0;       // seq del próximo registro
+  uint32_t offset = 0;    // offset del próximo registro en flash
+  uint32_t perdidos = 0;
+  TraceRegistro ram[RAM];
+  uint16_t ramHead = 0;
+  uint16_t ramCount = 0;
+
+  explicit AnilloTrazas(Flash &f) : flash(f) {}
+
+  uint32_t capacidad() const { return flash.tamano() / sizeof(TraceRegistro); }
+
+  // Ubica el final del anillo: sector con la seq más nueva y primer hueco dentro de él
+  void iniciar() {
+    uint32_t sectores = flash.tamano() / TRACE_SECTOR;
+    int32_t sectorNuevo = -1;
+    uint32_t seqNueva = 0;
+    TraceRegistro r;
+    for (uint32_t sec = 0; sec < sectores; sec++) {
+      flash.leer(sec * TRACE_SECTOR, &r, sizeof(r));
+      if (r.marca != TRACE_MARCA) continue;
+      if (sectorNuevo < 0 || (int32_t)(r.seq - seqNueva) > 0) {
+        sectorNuevo = sec;
+        seqNueva = r.seq;
+      }
+    }
+
+    seq = 0;
+    offset = 0;
+    ramHead = 0;
+    ramCount = 0;
+    if (sectorNuevo < 0) return;
+    offset = sectorNuevo * TRACE_SECTOR;
+    uint32_t fin = offset + TRACE_SECTOR;
+    while (offset < fin) {
+      flash.leer(offset, &r, sizeof(r));
+      if (r.marca != TRACE_MARCA) break;
+      seq = r.seq + 1;
+      offset += sizeof(r);
+    }
+  }
+
+  // false si el buffer está lleno y el registro se perdió
+  bool registrar(uint32_t tMs, uint8_t tipo, uint8_t aux, uint32_t valor) {
+    if (ramCount == RAM) {
+      perdidos++;
+      return false;
+    }
+    ram[(ramHead + ramCount) % RAM] = {seq, tMs, tipo, aux, TRACE_MARCA, valor};
+    ramCount++;
+    seq++;
+    return true;
+  }
+
+  // Escribe hasta 'max' registros del buffer en flash; devuelve cuántos
+  uint16_t volcar(uint16_t max) {
+    uint16_t escritos = 0;
+    while (ramCount > 0 && escritos < max) {
+      if (offset >= flash.tamano()) offset = 0;
+      if (offset % TRACE_SECTOR == 0) flash.borrar(offset, TRACE_SECTOR);
+      const TraceRegistro &r = ram[ramHead];
+      if (!flash.escribir(offset, &r, sizeof(r))) break;   // queda en RAM para el próximo intento
+      offset += sizeof(r);
+      ramHead = (ramHead + 1) % RAM;
+      ramCount--;
+      escritos++;
+    }
+    return escritos;
+  }
+
+  // Seq del primer registro que todavía está solo en RAM
+  uint32_t seqEnFlash() const { return seq - ramCount; }
+
+  // Seq más vieja que sigue garantizada (un sector de flash puede estar recién borrado)
+  uint32_t seqMasVieja() const {
+    uint32_t garantizados = (flash.tamano() - TRACE_SECTOR) / sizeof(TraceRegistro);
+    uint32_t fin = seqEnFlash();
+    return (fin > garantizados) ? fin - garantizados : 0;
+  }
+
+  // Lee el registro 'seq' de RAM o de flash; false si ya se pisó o todavía no existe
+  bool leer(uint32_t s, TraceRegistro &r) const {
+    uint32_t enRam = s - seqEnFlash();
+    if (enRam < ramCount) {
+      r = ram[(ramHead + enRam) % RAM];
+      return true;
+    }
+    uint32_t atras = seqEnFlash() - s;   // posiciones antes del cursor de escritura
+    if (atras == 0 || atras > capacidad()) return false;
+    uint32_t pos = (offset / sizeof(TraceRegistro) + capacidad() - atras) % capacidad();
+    flash.leer(pos * sizeof(TraceRegistro), &r, sizeof(r));
+    return r.marca == TRACE_MARCA && r.seq == s;
+  }
+};
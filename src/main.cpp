@@ -1,4 +1,4 @@
-#define MQTT_MAX_PACKET_SIZE 512
+#define MQTT_MAX_PACKET_SIZE 1536  // el listado de mascotas con campos derivados supera 512; se aplica con setBufferSize() en setup()
 #include <Arduino.h>
 #include <SPI.h>
 #include <MFRC522.h>
@@ -10,6 +10,17 @@
 #include <ArduinoJson.h>
 #include "esp_wifi.h"
 #include <Preferences.h>
+#include "esp_timer.h"
+#include "esp_sntp.h"
+#include "esp_partition.h"
+#include "esp_task_wdt.h"
+#include "esp_system.h"
+#include <Reloj.h>
+#include <TraceAnillo.h>
+#include <Pendientes.h>
+#include <Balanza.h>
+#include <Dosificacion.h>
+#include <Liberacion.h>
 
 
 // Prototipo requerido (Opción 1: declarar antes de usar)
@@ -32,6 +43,7 @@ void uidToString(const byte* uid, char* out, size_t outSize);
 #define MQTT_PORT     18830
 #define MQTT_CLIENTID "feeder01"
 #define TOPIC_EVENTOS "dispensador/feeder01/eventos"
+#define TOPIC_EVENTOS_ACK "dispensador/feeder01/eventos/ack"
 #define TOPIC_CONFIG  "dispensador/feeder01/config"
 #define TOPIC_CONFIG_ACK    "dispensador/feeder01/config/ack"
 #define TOPIC_CONFIG_STATUS "dispensador/feeder01/config/status"
@@ -39,6 +51,12 @@ void uidToString(const byte* uid, char* out, size_t outSize);
 #define ZONA_MUERTA_G 0.05
 
 #define TOPIC_MASCOTAS "dispensador/feeder01/mascotas"
+#define TOPIC_PARAMS   "dispensador/feeder01/params"
+#define TOPIC_TRACE    "dispensador/feeder01/trace"
+#define TOPIC_OVERRUNS "dispensador/feeder01/overruns"
+#define TOPIC_BALANZA  "dispensador/feeder01/balanza"
+#define TOPIC_SALIDA   "dispensador/feeder01/salida"
+#define TOPIC_SESIONES "dispensador/feeder01/sesiones"
 
 
 
@@ -50,7 +68,9 @@ WiFiClient espClient;
 PubSubClient mqtt(espClient);
 
 unsigned long ultimoEnvioMQTT = 0;
-const unsigned long INTERVALO_ENVIO_MQTT_MS = 15000; // 15s (ajusta a 3600000 para 1 hora)
+unsigned long INTERVALO_ENVIO_MQTT_MS = 15000; // 15s (ajusta a 3600000 para 1 hora)
+unsigned long SALIDA_BYTES_TICK = 1024;        // presupuesto de publicación por tick de salida
+unsigned long SALIDA_MSGS_TICK = 4;
 
 // ================ MODELO ==================
 #define UID_SIZE 4
@@ -59,7 +79,6 @@ const unsigned long INTERVALO_ENVIO_MQTT_MS = 15000; // 15s (ajusta a 3600000 pa
 
 #define UID_STR_LEN 12  // "AA:BB:CC:DD" + '\0'
 #define TS_STR_LEN 20   // "YYYY-MM-DDTHH:MM:SS" + '\0'
-#define EVENT_STR_LEN 20
 
 struct VentanaHoraria {
   uint16_t inicio; // minutos del día
@@ -67,48 +86,105 @@ struct VentanaHoraria {
   bool yaAlimentoHoy;
 };
 
+// Modo de dosificación por mascota; DOSIF_TOLVA usa el default de la tolva
+enum ModoDosificacion {
+  DOSIF_TOLVA = 0,
+  DOSIF_PULSOS = 1,
+  DOSIF_CONTINUO = 2
+};
+
 struct Mascota {
   byte uid[UID_SIZE];
   char nombre[16];
   float pesoObjetivoKg;
   VentanaHoraria ventanas[MAX_VENTANAS];
   uint8_t numVentanas;
+  uint8_t modoDosificacion;  // ModoDosificacion; ocupa el padding, no cambia el blob de NVS
 };
 
-Mascota mascotas[MAX_MASCOTAS];
+// Doble buffer de la tabla de mascotas: 'mascotas' apunta siempre a la versión
+// publicada, que no cambia estructuralmente mientras una sesión la usa. Las
+// escrituras por MQTT se arman en la otra tabla y se publican en loop() cuando
+// no hay sesión en curso (ver publicarConfigPendiente).
+Mascota tablasMascotas[2][MAX_MASCOTAS];
+uint8_t tablaActiva = 0;
+Mascota* mascotas = tablasMascotas[0];
 uint8_t numMascotas = 0;
 
+bool configPendiente = false;   // hay una versión armada esperando publicarse
+uint8_t numMascotasSiguiente = 0;
+uint32_t configVersionSiguiente = 0;
+
+// Gramos servidos hoy, paralelo a 'mascotas' (se reubica por UID al publicar tabla)
+uint16_t gramosHoy[MAX_MASCOTAS];
+
+// Respuestas ya serializadas para get_mascotas y status (ver CACHE DE RESPUESTAS)
+#define CACHE_MASCOTAS_LEN (MQTT_MAX_PACKET_SIZE - 64)  // deja lugar a topic y cabecera
+char cacheMascotas[CACHE_MASCOTAS_LEN];
+size_t cacheMascotasLen = 0;
+char cacheStatus[128];
+size_t cacheStatusLen = 0;
+uint32_t generacionRespuestas = 0;  // ++ cuando cambia algo derivado (comida, día)
+
 // forward declarations (se usan en el callback)
-int buscarMascota(byte *uid);
+int buscarMascota(const byte *uid);
 int buscarMascotaPorUIDStr(const char* uidStr);
 bool uidStringToBytes(const char* uidStr, byte* uidOut);
 
 // Añadir prototype para conectarMQTT
 bool conectarMQTT();
+void actualizarCacheRespuestas();
+uint32_t relojEpoch();
 
 // MQTT callback forward
 void mqttCallback(char* topic, byte* payload, unsigned int length);
 
 // ------------------ Cola de eventos ------------------
-#define MAX_EVENTOS 5
+// Con registros de 16 bytes caben 16 eventos en la RAM que antes usaban 5.
+#define MAX_EVENTOS 16
 
+// Por debajo de este epoch consideramos que NTP aún no sincronizó (2020-09-13)
+#define EPOCH_VALIDO_MIN 1600000000UL
 
 typedef enum {
   EVT_DOSIFICANDO,
   EVT_YA_COMIO_HOY,
   EVT_FUERA_HORARIO,
-  EVT_UID_NO_REGISTRADO
+  EVT_UID_NO_REGISTRADO,
+  EVT_ATASCO,             // puerta 2 cerró por tope con comida en la cámara
+  EVT_CAMARA_OCUPADA      // la cámara tiene la pre-porción de otra mascota
 } EventoTipo;
 
+#define EVT_FLAG_SIN_HORA 0x01  // epoch guarda segundos desde arranque, no hora real
+
+// Registro compacto: el formateo (fecha, nombre, texto del evento) se hace al publicar.
 struct Evento {
-  char timestamp[TS_STR_LEN];
-  char uid[UID_STR_LEN];
-  char evento[EVENT_STR_LEN];
+  uint32_t epoch;       // segundos UTC (o desde arranque si EVT_FLAG_SIN_HORA)
+  byte uid[UID_SIZE];
+  uint8_t tipo;         // EventoTipo
+  uint8_t flags;
+  uint16_t valor;       // DOSIFICANDO: gramos; rechazos: repeticiones agrupadas
+  uint16_t duracionS;   // rechazos agrupados: segundos entre el primero y el último
 };
 
 static Evento colaEventos[MAX_EVENTOS];
 static uint16_t colaHead = 0; // índice del primer elemento válido
 static uint16_t colaCount = 0; // cuántos elementos hay
+
+Evento* encolarEvento(const byte *uidBytes, EventoTipo tipo, uint16_t valor = 0);
+
+// Entrega al-menos-una-vez: cada evento tiene número de secuencia implícito
+// (seqHead + posición en la cola). Se publican hasta VENTANA_ENVIO eventos sin
+// confirmar y solo se retiran cuando el backend confirma acumulativamente
+// {"ack": seq} en TOPIC_EVENTOS_ACK. El backend deduplica por "seq".
+#define VENTANA_ENVIO 8
+#define SEQ_BLOQUE 256            // secuencias reservadas en NVS por escritura
+const unsigned long ACK_TIMEOUT_MS = 10000;
+
+static uint32_t seqHead = 0;       // seq del evento en colaHead (o del próximo si vacía)
+static uint32_t seqReservado = 0;  // primera seq no reservada en NVS
+static uint16_t colaEnviados = 0;  // eventos desde colaHead publicados y sin ACK
+static unsigned long tUltimoAck = 0;
 // -----------------------------------------------------
 
 Preferences prefs;
@@ -117,18 +193,37 @@ uint32_t configVersion = 0;
 
 
 // ================ CONSTANTES =============
-const unsigned long TIEMPO_ABIERTO_MS = 200;
-const unsigned long TIEMPO_ESTABLE_MS = 700;
-const unsigned long LED_ROJO_NO_AUT_MS = 10000;
-
-const unsigned long TIMEOUT_DOSIFICACION_MS = 20000; // 20 s
-const float MARGEN_CORTE_ANTICIPADO_KG = 0.002;
+// Los valores no-const son ajustables en runtime (ver registro de parámetros);
+// aquí van sus defaults.
+unsigned long TIEMPO_ABIERTO_MS = 200;
+unsigned long TIEMPO_ESTABLE_MS = 700;
+unsigned long LED_ROJO_NO_AUT_MS = 10000;
+
+unsigned long TIMEOUT_DOSIFICACION_MS = 20000; // 20 s
+float MARGEN_CORTE_ANTICIPADO_KG = MARGEN_CORTE_DEFECTO_KG;
 const unsigned long LED_VERDE_BLINK_MS = 40;
 
+// Puerta 2 cierra apenas la cámara queda vacía; TIEMPO_PUERTA2_ABIERTA_MS es el tope.
+// Los tiempos fijos de la liberación están en lib/Liberacion.
+unsigned long TIEMPO_PUERTA2_ABIERTA_MS = 5000;
+float LIB_UMBRAL_VACIO_KG = 0.005;              // por encima al llegar al tope -> atasco
+
+// Pre-porcionado: pesar la próxima porción en la cámara antes de que abra la ventana
+unsigned long PREPORCION_ACTIVA = 0;        // 0 = deshabilitado
+unsigned long PREPORCION_ANTICIPO_MIN = 15; // minutos antes del inicio de ventana
+
+unsigned long RECHAZO_COOLDOWN_MS = 60000;  // agrupa rechazos repetidos del mismo UID
+
+unsigned long AUTO_TARA_ACTIVA = 1;
+unsigned long AUTO_TARA_INTERVALO_MS = 1800000; // re-tara periódica con la FSM ociosa (30 min)
+
+unsigned long MODO_DOSIFICACION_TOLVA = DOSIF_PULSOS; // modo de mascotas con DOSIF_TOLVA
+const unsigned long PREPORCION_PLAN_MS = 60000;
+
 float CALIBRATION_FACTOR = 1990000.0;
 
 
-int ultimoDia = -1;
+int32_t ultimoDia = -1;
 int matchedWindowIndex = -1; // índice de ventana que permitió la validación (por sesión)
 
 // ================ OBJETOS =================
@@ -137,6 +232,121 @@ Servo servoPuerta1;
 Servo servoPuerta2;
 HX711 balanza;
 
+// ================ PARAMETROS AJUSTABLES ===
+// Registro tipado de parámetros: se leen directamente de las variables globales
+// (mismo costo que una constante) y se cambian por MQTT con get_param/set_param.
+enum ParamTipo {
+  PARAM_ULONG,
+  PARAM_FLOAT
+};
+
+struct Parametro {
+  const char* nombre;
+  ParamTipo tipo;
+  void* valor;
+  float minimo;
+  float maximo;
+  float defecto;
+};
+
+// El orden define la posición en el blob de NVS: agregar nuevos solo al final.
+Parametro parametros[] = {
+  {"tiempo_abierto_ms",        PARAM_ULONG, &TIEMPO_ABIERTO_MS,          20,     2000,      200},
+  {"tiempo_estable_ms",        PARAM_ULONG, &TIEMPO_ESTABLE_MS,          100,    5000,      700},
+  {"timeout_dosificacion_ms",  PARAM_ULONG, &TIMEOUT_DOSIFICACION_MS,    2000,   120000,    20000},
+  {"margen_corte_kg",          PARAM_FLOAT, &MARGEN_CORTE_ANTICIPADO_KG, 0.0,    0.1,       MARGEN_CORTE_DEFECTO_KG},
+  {"calibration_factor",       PARAM_FLOAT, &CALIBRATION_FACTOR,         1000.0, 10000000.0, 1990000.0},
+  {"intervalo_envio_mqtt_ms",  PARAM_ULONG, &INTERVALO_ENVIO_MQTT_MS,    1000,   3600000,   15000},
+  {"led_rojo_no_aut_ms",       PARAM_ULONG, &LED_ROJO_NO_AUT_MS,         0,      60000,     10000},
+  {"tiempo_puerta2_ms",        PARAM_ULONG, &TIEMPO_PUERTA2_ABIERTA_MS,  500,    30000,     5000},
+  {"preporcion_activa",        PARAM_ULONG, &PREPORCION_ACTIVA,          0,      1,         0},
+  {"preporcion_anticipo_min",  PARAM_ULONG, &PREPORCION_ANTICIPO_MIN,    0,      240,       15},
+  {"rechazo_cooldown_ms",      PARAM_ULONG, &RECHAZO_COOLDOWN_MS,        0,      3600000,   60000},
+  {"auto_tara_activa",         PARAM_ULONG, &AUTO_TARA_ACTIVA,           0,      1,         1},
+  {"auto_tara_intervalo_ms",   PARAM_ULONG, &AUTO_TARA_INTERVALO_MS,     60000,  86400000,  1800000},
+  {"modo_dosificacion",        PARAM_ULONG, &MODO_DOSIFICACION_TOLVA,    1,      2,         1},
+  {"salida_bytes_tick",        PARAM_ULONG, &SALIDA_BYTES_TICK,          256,    16384,     1024},
+  {"salida_msgs_tick",         PARAM_ULONG, &SALIDA_MSGS_TICK,           1,      32,        4},
+  {"liberacion_vacio_kg",      PARAM_FLOAT, &LIB_UMBRAL_VACIO_KG,        0.001,  0.05,      0.005},
+};
+
+#define NUM_PARAMETROS (sizeof(parametros) / sizeof(parametros[0]))
+
+int buscarParametro(const char* nombre) {
+  for (uint8_t i = 0; i < NUM_PARAMETROS; i++) {
+    if (strcmp(parametros[i].nombre, nombre) == 0) return i;
+  }
+  return -1;
+}
+
+float leerParametro(const Parametro &p) {
+  if (p.tipo == PARAM_ULONG) return (float)*(unsigned long*)p.valor;
+  return *(float*)p.valor;
+}
+
+// Aplica un valor validando rango. Devuelve false si está fuera de límites.
+bool escribirParametro(const Parametro &p, float v) {
+  if (isnan(v) || v < p.minimo || v > p.maximo) return false;
+  if (p.tipo == PARAM_ULONG) {
+    *(unsigned long*)p.valor = (unsigned long)(v + 0.5f);
+  } else {
+    *(float*)p.valor = v;
+  }
+  if (p.valor == &CALIBRATION_FACTOR) balanza.set_scale(CALIBRATION_FACTOR);
+  return true;
+}
+
+// set_param solo marca; guardarParamsPendientes() los lleva a NVS desde loop()
+bool paramsPendientes = false;
+
+// Arma el blob de NVS: un uint32 por parámetro (float se guarda por bits)
+void armarBlobParametros(uint32_t* blob) {
+  for (uint8_t i = 0; i < NUM_PARAMETROS; i++) {
+    if (parametros[i].tipo == PARAM_ULONG) {
+      blob[i] = (uint32_t)*(unsigned long*)parametros[i].valor;
+    } else {
+      memcpy(&blob[i], parametros[i].valor, sizeof(float));
+    }
+  }
+}
+
+// Se llama desde la tarea de persistencia, por eso usa su propio Preferences.
+void saveParamsToNVS(const uint32_t* blob) {
+  Preferences p;
+  p.begin(PREF_NAMESPACE, false);
+  p.putBytes("params", blob, sizeof(uint32_t) * NUM_PARAMETROS);
+  p.end();
+  Serial.println("Parametros guardados en NVS");
+}
+
+// Carga parámetros guardados; los ausentes o fuera de rango quedan en su default
+void loadParamsFromNVS() {
+  uint32_t blob[NUM_PARAMETROS];
+  prefs.begin(PREF_NAMESPACE, true);
+  size_t bytes = prefs.isKey("params") ? prefs.getBytesLength("params") : 0;
+  if (bytes > sizeof(blob)) bytes = sizeof(blob);
+  if (bytes > 0) prefs.getBytes("params", blob, bytes);
+  prefs.end();
+
+  uint8_t guardados = bytes / sizeof(uint32_t);
+  for (uint8_t i = 0; i < NUM_PARAMETROS; i++) {
+    Parametro &p = parametros[i];
+    float v = p.defecto;
+    if (i < guardados) {
+      if (p.tipo == PARAM_ULONG) {
+        v = (float)blob[i];
+      } else {
+        memcpy(&v, &blob[i], sizeof(float));
+      }
+    }
+    if (!escribirParametro(p, v)) {
+      Serial.printf("Parametro %s fuera de rango en NVS, usando default\n", p.nombre);
+      escribirParametro(p, p.defecto);
+    }
+  }
+  Serial.printf("Parametros cargados: %u de NVS\n", (unsigned)guardados);
+}
+
 // ================ FSM =====================
 enum ResultadoValidacion {
   VALIDACION_OK,
@@ -155,27 +365,738 @@ enum EstadoSistema {
 EstadoSistema estadoActual = ESPERANDO_TARJETA;
 int indiceMascotaActual = -1;
 
+// Liberación por puerta 2 en segundo plano: mientras cae la porción anterior,
+// la FSM ya puede leer y validar a la siguiente mascota.
+enum FaseLiberacion {
+  LIB_INACTIVA,
+  LIB_ABIERTA,
+  LIB_CERRANDO
+};
+
+FaseLiberacion faseLiberacion = LIB_INACTIVA;
+unsigned long tFaseLiberacion = 0;
+Liberacion liberacion;               // peso promediado y vacío mientras puerta 2 está abierta
+byte uidLiberacion[UID_SIZE];        // mascota de la porción que se está liberando
+uint32_t atascosLiberacion = 0;
+
+// Tiempos por sesión medidos en el equipo (get_sesiones): cuánto
+// tarda una mascota desde el tap hasta la apertura de puerta 2, cuánto de eso
+// fue esperar a que terminara la liberación anterior, y cuánto dura cada liberación.
+struct TiemposSesion {
+  uint32_t sesiones;
+  uint32_t sumaSesionMs;
+  uint32_t sumaEsperaPuerta2Ms;
+  uint32_t liberaciones;
+  uint32_t sumaLiberacionMs;
+};
+
+TiemposSesion tiemposSesion = {};
+unsigned long tInicioSesion = 0;
+unsigned long tEsperaPuerta2 = 0;    // 0 = DOSIFICANDO todavía no tuvo que esperar
+unsigned long tInicioLiberacion = 0;
+uint32_t esperaPuerta2Sesion = 0;
+
+bool bloqueoIniciado = false;
+unsigned long tInicioBloqueo = 0;
+unsigned long duracionBloqueo = 0;  // lo fija registrarRechazo()
+
+// Porción ya pesada esperando en la cámara (entre puerta 1 y puerta 2). Es de
+// una sola mascota (por UID, sobrevive a cambios de tabla); sin dueño nadie la recibe
+// hasta re-planificarla.
+bool prePorcionLista = false;
+float prePorcionKg = 0.0;
+byte prePorcionUid[UID_SIZE];
+bool prePorcionConDueno = false;
+unsigned long tUltimoPlanPrePorcion = 0;
+bool escanearEnDosis = false;   // pre-porción en curso: las tarjetas siguen entrando a pendientes
+
 // ================ UID TEMP ================
 byte uidLeido[UID_SIZE];
 bool hayUIDLeido = false;
 
+// ================ RFID MULTI-TAG ==========
+// Cada escaneo enumera todas las tarjetas del campo (REQA + anticolisión del
+// PICC_Select + HLTA para silenciar la ya leída). Las lecturas se deduplican con
+// un caché de vistos recientes y pasan a una cola de mascotas pendientes. El
+// barrido, la deduplicación y los TTL están en lib/Pendientes.
+#define RFID_MAX_POR_ESCANEO 4
+#define RFID_CACHE_VISTOS 8
+#define MAX_PENDIENTES 4
+
+#define RECHAZO_NINGUNO 0xFF
+const unsigned long RECHAZO_REPETIDO_LED_MS = 1000; // LED rojo corto para rechazos repetidos
+
+// uid, tVisto y usado vienen de EntradaVisto (lib/Pendientes)
+struct UIDVisto : EntradaVisto {
+  // Agrupación de rechazos repetidos (ver registrarRechazo)
+  uint8_t rechazo;              // EventoTipo del último rechazo o RECHAZO_NINGUNO
+  uint16_t repeticiones;        // rechazos dentro del cooldown aún no reportados
+  uint32_t epochPrimero;
+  uint32_t epochUltimo;
+  uint8_t flagsEpoch;
+  unsigned long tPrimerRechazo;  // inicio del cooldown; los repetidos no lo corren
+  uint32_t cfgRechazo;          // configVersion al rechazar
+  int32_t diaRechazo;
+  uint32_t venceMinRechazo;     // minuto local del próximo borde de ventana
+};
+
+UIDVisto uidsVistos[RFID_CACHE_VISTOS];
+ColaPendientes<MAX_PENDIENTES> pendientes;
+
+// ================ SALIDA MQTT =============
+// Todo lo que se publica pasa por carriles. Control (ACKs de config) sale
+// siempre primero; estado, eventos y listados se turnan de a un mensaje para
+// que un backlog de eventos o un listado largo no demore al resto. Cada
+// SALIDA_TICK_MS se renueva un presupuesto de bytes y de mensajes.
+enum Carril {
+  CARRIL_CONTROL = 0,
+  CARRIL_ESTADO,
+  CARRIL_EVENTOS,
+  CARRIL_MASIVO,
+  NUM_CARRILES
+};
+
+const char* const NOMBRE_CARRIL[NUM_CARRILES] = {"control", "estado", "eventos", "masivo"};
+
+// Publicaciones que se generan al momento de enviarlas; pedir una que ya
+// está pendiente no la duplica.
+enum SalidaItem {
+  SAL_CONFIG_STATUS = 0,
+  SAL_PARAMS,
+  SAL_BALANZA,
+  SAL_OVERRUNS,
+  SAL_METRICAS,
+  SAL_SESIONES,
+  SAL_MASCOTAS,
+  SAL_TRACE,
+  NUM_SALIDA_ITEMS
+};
+
+const uint8_t CARRIL_DE_ITEM[NUM_SALIDA_ITEMS] = {
+  CARRIL_ESTADO, CARRIL_ESTADO, CARRIL_ESTADO, CARRIL_ESTADO, CARRIL_ESTADO,
+  CARRIL_ESTADO, CARRIL_MASIVO, CARRIL_MASIVO
+};
+
+#define CONTROL_SLOTS 6
+#define CONTROL_MSG_LEN 128
+#define SALIDA_MAX_REINTENTOS 3   // fallos seguidos antes de descartar un item o ACK
+const unsigned long SALIDA_TICK_MS = 100;
+
+struct MensajeControl {
+  char payload[CONTROL_MSG_LEN];
+  unsigned long tEncolado;
+};
+
+struct MetricaCarril {
+  uint32_t enviados;
+  uint32_t bytes;
+  uint32_t esperaSumaMs;   // espera desde el pedido hasta el publish
+  uint32_t esperaMaxMs;
+  uint32_t fallos;         // publish fallidos con la conexión arriba
+  uint32_t descartados;    // items o ACKs abandonados tras SALIDA_MAX_REINTENTOS
+};
+
+static MensajeControl colaControl[CONTROL_SLOTS];
+static uint8_t controlHead = 0;
+static uint8_t controlCount = 0;
+static uint32_t controlDescartados = 0;
+
+static uint8_t salidaPendiente = 0;                    // bit por SalidaItem
+static unsigned long tSolicitudItem[NUM_SALIDA_ITEMS];
+static uint8_t reintentosItem[NUM_SALIDA_ITEMS];
+static int paramPedido = -1;                           // índice en parametros[]; -1 -> todos
+static uint8_t paramCursor = 0;                        // próximo a publicar si son todos
+static bool eventosSolicitados = false;
+static unsigned long tSolicitudEventos = 0;
+
+static MetricaCarril metricasCarril[NUM_CARRILES];
+static uint32_t ticksSaturados = 0;                    // ticks que agotaron el presupuesto con cola
+
+void solicitarSalida(SalidaItem item) {
+  if (salidaPendiente & (1 << item)) return;
+  salidaPendiente |= (1 << item);
+  tSolicitudItem[item] = millis();
+  reintentosItem[item] = 0;
+}
+
+// Pide publicar un parámetro (índice) o todos (-1). Guarda el índice y no el
+// nombre: el nombre del pedido apunta al buffer de PubSubClient.
+// Dos pedidos distintos antes de enviarse -> se publican todos.
+void solicitarParametros(int idx) {
+  bool pendiente = salidaPendiente & (1 << SAL_PARAMS);
+  paramPedido = (pendiente && paramPedido != idx) ? -1 : idx;
+  paramCursor = 0;
+  solicitarSalida(SAL_PARAMS);
+}
+
+// Habilita el carril de eventos hasta llenar la ventana de envío
+void solicitarEventos() {
+  if (eventosSolicitados) return;
+  eventosSolicitados = true;
+  tSolicitudEventos = millis();
+}
+
+void encolarControl(const char* payload) {
+  if (controlCount == CONTROL_SLOTS) {
+    Serial.println("Cola de control llena, se descarta el mensaje mas viejo");
+    controlHead = (controlHead + 1) % CONTROL_SLOTS;
+    controlCount--;
+    controlDescartados++;
+  }
+  MensajeControl &m = colaControl[(controlHead + controlCount) % CONTROL_SLOTS];
+  strncpy(m.payload, payload, CONTROL_MSG_LEN - 1);
+  m.payload[CONTROL_MSG_LEN - 1] = '\0';
+  m.tEncolado = millis();
+  controlCount++;
+}
+
+// ================ MONITOR DE PLAZOS =======
+// Cada estado de la FSM y cada operación de red declara un presupuesto de
+// tiempo. Los excesos se guardan en RAM RTC (sobrevive resets por software y
+// watchdog) con el sitio que los causó. Si el loop se cuelga de verdad, el task
+// watchdog reinicia y setup() deja las puertas cerradas.
+#define WDT_TIMEOUT_S 30
+#define MAX_OVERRUNS 16
+#define SITIO_LEN 16
+#define PLAZOS_ANIDADOS 4
+#define OVERRUNS_MARCA 0x0DEAD11E
+#define DURACION_CUELGUE 0xFFFFFFFF   // entrada generada tras reset por watchdog
+#define OVERRUNS_POR_MENSAJE 4
+
+struct Overrun {
+  uint32_t epoch;          // 0 si no había hora
+  uint32_t tArranqueMs;    // millis() al terminar
+  uint32_t duracionMs;
+  uint32_t presupuestoMs;
+  char sitio[SITIO_LEN];
+};
+
+struct RegistroOverruns {
+  uint32_t marca;
+  uint16_t head;
+  uint16_t count;
+  uint32_t total;                 // excesos desde el último borrado
+  char sitioActivo[SITIO_LEN];    // plazo abierto más interno; "" si ninguno
+  Overrun regs[MAX_OVERRUNS];
+};
+
+RTC_NOINIT_ATTR RegistroOverruns overruns;
+
+struct Plazo {
+  const char* sitio;
+  uint32_t presupuestoMs;
+  unsigned long tInicio;
+};
+
+static Plazo plazos[PLAZOS_ANIDADOS];
+static uint8_t numPlazos = 0;
+
+void registrarOverrun(const char* sitio, uint32_t duracionMs, uint32_t presupuestoMs) {
+  Overrun &o = overruns.regs[(overruns.head + overruns.count) % MAX_OVERRUNS];
+  if (overruns.count < MAX_OVERRUNS) {
+    overruns.count++;
+  } else {
+    overruns.head = (overruns.head + 1) % MAX_OVERRUNS; // pisa el más viejo
+  }
+  o.epoch = relojEpoch();
+  o.tArranqueMs = millis();
+  o.duracionMs = duracionMs;
+  o.presupuestoMs = presupuestoMs;
+  strncpy(o.sitio, sitio, SITIO_LEN);
+  o.sitio[SITIO_LEN - 1] = '\0';
+  overruns.total++;
+}
+
+void plazoIniciar(const char* sitio, uint32_t presupuestoMs) {
+  if (numPlazos >= PLAZOS_ANIDADOS) return;
+  plazos[numPlazos++] = {sitio, presupuestoMs, millis()};
+  strncpy(overruns.sitioActivo, sitio, SITIO_LEN);
+  overruns.sitioActivo[SITIO_LEN - 1] = '\0';
+}
+
+void plazoTerminar() {
+  if (numPlazos == 0) return;
+  const Plazo &p = plazos[--numPlazos];
+  uint32_t dur = millis() - p.tInicio;
+  if (dur > p.presupuestoMs) {
+    registrarOverrun(p.sitio, dur, p.presupuestoMs);
+    Serial.printf("PLAZO excedido en %s: %u ms (presupuesto %u ms)\n",
+                  p.sitio, (unsigned)dur, (unsigned)p.presupuestoMs);
+  }
+  const char* activo = numPlazos ? plazos[numPlazos - 1].sitio : "";
+  strncpy(overruns.sitioActivo, activo, SITIO_LEN);
+  overruns.sitioActivo[SITIO_LEN - 1] = '\0';
+}
+
+// Valida el registro RTC y, si el reset fue por cuelgue, anota dónde ocurrió.
+// Devuelve true si el arranque viene de un watchdog o panic.
+bool iniciarMonitorPlazos() {
+  esp_reset_reason_t motivo = esp_reset_reason();
+  if (overruns.marca != OVERRUNS_MARCA || overruns.count > MAX_OVERRUNS ||
+      overruns.head >= MAX_OVERRUNS || motivo == ESP_RST_POWERON) {
+    memset(&overruns, 0, sizeof(overruns));
+    overruns.marca = OVERRUNS_MARCA;
+  }
+  overruns.sitioActivo[SITIO_LEN - 1] = '\0';
+
+  bool cuelgue = (motivo == ESP_RST_TASK_WDT || motivo == ESP_RST_INT_WDT ||
+                  motivo == ESP_RST_WDT || motivo == ESP_RST_PANIC);
+  if (cuelgue) {
+    const char* sitio = overruns.sitioActivo[0] ? overruns.sitioActivo : "desconocido";
+    Serial.printf("Reinicio por watchdog/panic (motivo %d) en %s\n", (int)motivo, sitio);
+    registrarOverrun(sitio, DURACION_CUELGUE, 0);
+  }
+  overruns.sitioActivo[0] = '\0';
+  Serial.printf("Overruns registrados: %u (total %u)\n", (unsigned)overruns.count, (unsigned)overruns.total);
+
+  esp_task_wdt_init(WDT_TIMEOUT_S, true);  // true: panic -> reset
+  esp_task_wdt_add(NULL);                  // vigilar la tarea del loop
+  return cuelgue;
+}
+
+void alimentarWatchdog() {
+  esp_task_wdt_reset();
+}
+
+static uint16_t overrunsCursor = 0;   // próxima entrada a publicar
+
+void solicitarOverruns() {
+  overrunsCursor = 0;
+  solicitarSalida(SAL_OVERRUNS);
+}
+
+// Publica el registro de excesos en TOPIC_OVERRUNS de a OVERRUNS_POR_MENSAJE
+// entradas: {"total":..,"desde":i,"overruns":[...]}. 'fin' = ya salió la última página.
+size_t publishOverruns(bool &fin) {
+  StaticJsonDocument<768> doc;
+  uint16_t desde = overrunsCursor;
+  if (desde > overruns.count) desde = overruns.count; // el registro se borró entre páginas
+  doc["total"] = overruns.total;
+  doc["desde"] = desde;
+  JsonArray arr = doc.createNestedArray("overruns");
+  uint16_t hasta = desde + OVERRUNS_POR_MENSAJE;
+  if (hasta > overruns.count) hasta = overruns.count;
+  for (uint16_t i = desde; i < hasta; i++) {
+    const Overrun &o = overruns.regs[(overruns.head + i) % MAX_OVERRUNS];
+    JsonObject jo = arr.createNestedObject();
+    jo["sitio"] = o.sitio;
+    jo["epoch"] = o.epoch;
+    jo["t_ms"] = o.tArranqueMs;
+    if (o.duracionMs == DURACION_CUELGUE) {
+      jo["cuelgue"] = true;
+    } else {
+      jo["dur_ms"] = o.duracionMs;
+      jo["presupuesto_ms"] = o.presupuestoMs;
+    }
+  }
+
+  char buffer[768];
+  size_t n = serializeJson(doc, buffer, sizeof(buffer));
+  fin = false;
+  if (!mqtt.publish(TOPIC_OVERRUNS, (const uint8_t*)buffer, n, false)) return 0;
+  overrunsCursor = hasta;
+  if (hasta < overruns.count) return n;
+  fin = true;
+  Serial.println("Overruns publicados");
+  return n;
+}
+
+// Tiempos por sesión en TOPIC_SESIONES: promedios desde el arranque
+size_t publishSesiones() {
+  StaticJsonDocument<192> doc;
+  const TiemposSesion &t = tiemposSesion;
+  doc["sesiones"] = t.sesiones;
+  doc["sesion_prom_ms"] = t.sesiones ? t.sumaSesionMs / t.sesiones : 0;
+  doc["espera_puerta2_prom_ms"] = t.sesiones ? t.sumaEsperaPuerta2Ms / t.sesiones : 0;
+  doc["liberaciones"] = t.liberaciones;
+  doc["liberacion_prom_ms"] = t.liberaciones ? t.sumaLiberacionMs / t.liberaciones : 0;
+
+  char buffer[192];
+  size_t n = serializeJson(doc, buffer, sizeof(buffer));
+  if (!mqtt.publish(TOPIC_SESIONES, (const uint8_t*)buffer, n, false)) return 0;
+  Serial.println("Sesiones publicadas");
+  return n;
+}
+
+// ================ TRAZAS ==================
+// Grabador de trazas en un anillo sobre la partición "trace" (ver partitions.csv
+// y lib/TraceAnillo, donde están los tipos de registro). Los registros esperan
+// en RAM y se escriben en flash con el equipo ocioso (traceVolcar). Se vuelca
+// por MQTT con "dump_trace".
+#define TRACE_SUBTYPE 0x40
+#define TRACE_POR_MENSAJE 8
+#define TRACE_VOLCADO_MAX 32   // registros por vuelta de loop(): a lo sumo un borrado de sector
+
+enum TraceAccion {
+  TRA_DESCONOCIDA,
+  TRA_GET_MASCOTAS,
+  TRA_DELETE,
+  TRA_UPSERT,
+  TRA_GET_PARAM,
+  TRA_SET_PARAM,
+  TRA_DUMP_TRACE,
+  TRA_GET_OVERRUNS,
+  TRA_BALANZA,
+  TRA_GET_SALIDA,
+  TRA_GET_SESIONES
+};
+
+// Adaptador de la partición para AnilloTrazas
+struct FlashParticion {
+  const esp_partition_t* part;
+  uint32_t tamano() const { return part->size; }
+  void leer(uint32_t off, void* buf, uint32_t n) const { esp_partition_read(part, off, buf, n); }
+  bool escribir(uint32_t off, const void* buf, uint32_t n) { return esp_partition_write(part, off, buf, n) == ESP_OK; }
+  void borrar(uint32_t off, uint32_t n) { esp_partition_erase_range(part, off, n); }
+};
+
+static const esp_partition_t* tracePart = nullptr;
+static FlashParticion traceFlash = {nullptr};
+static AnilloTrazas<FlashParticion> traceAnillo(traceFlash);
+
+uint32_t empaquetarUID(const byte* uid) {
+  return ((uint32_t)uid[0] << 24) | ((uint32_t)uid[1] << 16) | ((uint32_t)uid[2] << 8) | uid[3];
+}
+
+void traceIniciar() {
+  tracePart = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                       (esp_partition_subtype_t)TRACE_SUBTYPE, "trace");
+  if (!tracePart) {
+    Serial.println("Trace: particion no encontrada, trazas deshabilitadas");
+    return;
+  }
+  traceFlash.part = tracePart;
+  traceAnillo.iniciar();
+  Serial.printf("Trace: %u KB, proxima seq %u\n", (unsigned)(tracePart->size / 1024), (unsigned)traceAnillo.seq);
+}
+
+void traceRegistrar(TraceTipo tipo, uint8_t aux, uint32_t valor, unsigned long t = millis()) {
+  if (!tracePart) return;
+  traceAnillo.registrar((uint32_t)t, (uint8_t)tipo, aux, valor);
+}
+
+void traceRegistrarFloat(TraceTipo tipo, uint8_t aux, float v, unsigned long t = millis()) {
+  uint32_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  traceRegistrar(tipo, aux, bits, t);
+}
+
+// Lectura cruda del HX711 (cuentas, con o sin el cero según 'origen')
+void traceRegistrarHx711(TraceHx711 origen, long cuentas, unsigned long t = millis()) {
+  traceRegistrar(TR_HX711, origen, (uint32_t)(int32_t)cuentas, t);
+}
+
+bool liberacionEnCurso();
+
+// Llamado desde loop(): pasa a flash lo acumulado en RAM sin sesión ni
+// liberación en curso, para que el borrado de un sector no caiga en los lazos
+void traceVolcar() {
+  if (!tracePart || traceAnillo.ramCount == 0) return;
+  if (estadoActual != ESPERANDO_TARJETA || liberacionEnCurso()) return;
+  traceAnillo.volcar(TRACE_VOLCADO_MAX);
+}
+
+uint32_t traceSeqMasVieja() {
+  if (!tracePart) return traceAnillo.seq;
+  return traceAnillo.seqMasVieja();
+}
+
+static uint32_t traceEnvioDesde = 0;
+static uint32_t traceEnvioSeq = 0;   // próximo registro a publicar
+static uint16_t traceEnvioMax = 0;
+
+// Pide publicar hasta 'max' registros desde 'desde'; el carril masivo los envía
+// de a TRACE_POR_MENSAJE: {"regs":[[seq,t_ms,tipo,aux,valor],...]} y al final
+// {"fin":true,"siguiente":seq,"perdidos":n} (n = descartados con el buffer lleno)
+void solicitarTrace(uint32_t desde, uint16_t max) {
+  if (!tracePart) return;
+  if ((int32_t)(desde - traceSeqMasVieja()) < 0) desde = traceSeqMasVieja();
+  traceEnvioDesde = desde;
+  traceEnvioSeq = desde;
+  traceEnvioMax = max;
+  solicitarSalida(SAL_TRACE);
+}
+
+// Publica el siguiente mensaje de la traza pedida; 'fin' = salió el cierre
+size_t publishTraceBloque(bool &fin) {
+  fin = false;
+  if (!tracePart) { fin = true; return 0; }
+
+  uint32_t traceSeq = traceAnillo.seq;
+  uint32_t &seq = traceEnvioSeq;
+  uint32_t desde = traceEnvioDesde;
+  uint16_t max = traceEnvioMax;
+  char buf[384];
+
+  if (seq != traceSeq && (uint32_t)(seq - desde) < max) {
+    uint32_t seqBloque = seq;
+    int n = snprintf(buf, sizeof(buf), "{\"regs\":[");
+    for (uint8_t k = 0; k < TRACE_POR_MENSAJE && seq != traceSeq && (uint32_t)(seq - desde) < max; k++, seq++) {
+      TraceRegistro r;
+      if (!traceAnillo.leer(seq, r)) continue;
+      n += snprintf(buf + n, sizeof(buf) - n, "%s[%u,%u,%u,%u,%u]", (buf[n - 1] == '[') ? "" : ",",
+                    (unsigned)r.seq, (unsigned)r.t_ms, (unsigned)r.tipo, (unsigned)r.aux, (unsigned)r.valor);
+    }
+    n += snprintf(buf + n, sizeof(buf) - n, "]}");
+    if (mqtt.publish(TOPIC_TRACE, buf, false)) return n;
+    seq = seqBloque; // reintentar el mismo bloque
+    return 0;
+  }
+
+  int n = snprintf(buf, sizeof(buf), "{\"fin\":true,\"siguiente\":%u,\"perdidos\":%u}",
+                   (unsigned)seq, (unsigned)traceAnillo.perdidos);
+  if (!mqtt.publish(TOPIC_TRACE, buf, false)) return 0;
+  fin = true;
+  Serial.printf("Trace publicado: seq %u..%u\n", (unsigned)desde, (unsigned)seq);
+  return n;
+}
+
+// ================ BALANZA: TARA Y DERIVA ==
+// Re-tara automática cuando la cámara se sabe vacía (tras cerrar puerta 2 o
+// periódicamente con la FSM ociosa), modelo lineal de deriva del cero para
+// compensar entre taras, y calibración multipunto guardada en NVS. La curva y
+// el ajuste de deriva están en lib/Balanza.
+#define HIST_TARA 8
+#define MAX_PUNTOS_CAL 4
+const float AUTO_TARA_ESTABLE_KG = 0.002;  // diferencia máxima entre dos promedios
+const float AUTO_TARA_MAX_KG = 0.010;      // más que esto no es deriva: cámara no vacía
+const unsigned long DERIVA_MIN_ANTIGUEDAD_MS = 300000; // compensar solo si la tara tiene > 5 min
+const uint32_t DERIVA_MAX_EXTRAPOLACION_S = 21600;     // no extrapolar más de 6 h
+
+MuestraTara histTara[HIST_TARA];
+uint8_t histTaraHead = 0;
+uint8_t histTaraCount = 0;
+float derivaCuentasPorSeg = 0.0;
+bool autoTaraPendiente = false;
+unsigned long tUltimaTara = 0;
+uint32_t autoTarasRechazadas = 0;
+
+// Tara, punto de calibración y borrado de la curva pedidos por MQTT. El callback
+// puede correr dentro de mqtt.loop() en plena dosificación o liberación, así que
+// solo se anotan y los ejecuta atenderBalanzaPedida() con la cámara ociosa.
+bool taraPedida = false;
+bool calibPedida = false;
+bool calibResetPedido = false;
+float calibPedidaKg = 0.0;
+
+void sendConfigAck(const char* action, const char* uidStr, const char* status);
+
+PuntoCalibracion puntosCal[MAX_PUNTOS_CAL];  // ordenados por crudo
+uint8_t numPuntosCal = 0;
+
+// Convierte cuentas sobre el cero a kg: multipunto si hay puntos, si no CALIBRATION_FACTOR
+float kgDesdeCrudo(float crudo) {
+  return balanzaKgDesdeCrudo(puntosCal, numPuntosCal, crudo, CALIBRATION_FACTOR);
+}
+
+// Recalcula la pendiente de deriva (cuentas/s) por mínimos cuadrados sobre el historial
+void recalcularDeriva() {
+  derivaCuentasPorSeg = balanzaPendienteDeriva(histTara, histTaraHead, histTaraCount, HIST_TARA);
+}
+
+// Segundos desde el arranque para el modelo de deriva; millis()/1000 salta a 0
+// a los 49 días y rompería el ajuste
+uint32_t segundosArranque() {
+  return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+void registrarTara(long offset) {
+  MuestraTara &m = histTara[(histTaraHead + histTaraCount) % HIST_TARA];
+  if (histTaraCount < HIST_TARA) {
+    histTaraCount++;
+  } else {
+    histTaraHead = (histTaraHead + 1) % HIST_TARA;
+  }
+  m.tSeg = segundosArranque();
+  m.epoch = relojEpoch();
+  m.offset = offset;
+  tUltimaTara = millis();
+  recalcularDeriva();
+}
+
+// Tara con la cámara vacía: dos promedios estables y dentro del rango de deriva.
+// Deja la balanza apagada. Devuelve true si aplicó el nuevo cero.
+bool autoTarar() {
+  plazoIniciar("autoTara", 2500);
+  balanza.power_up();
+  delay(120);
+  long a = balanza.read_average(5);
+  long b = balanza.read_average(5);
+  balanza.power_down();
+  plazoTerminar();
+  traceRegistrarHx711(TRH_TARA, a);
+  traceRegistrarHx711(TRH_TARA, b);
+
+  long nuevo = (a + b) / 2;
+  if (fabs(kgDesdeCrudo((float)(a - b))) > AUTO_TARA_ESTABLE_KG) {
+    Serial.println("Auto-tara: lectura inestable, se omite");
+    autoTarasRechazadas++;
+    return false;
+  }
+  float corrimientoKg = kgDesdeCrudo((float)(nuevo - balanza.get_offset()));
+  if (fabs(corrimientoKg) > AUTO_TARA_MAX_KG) {
+    Serial.printf("Auto-tara: %.3f kg sobre el cero, camara no vacia\n", corrimientoKg);
+    autoTarasRechazadas++;
+    return false;
+  }
+
+  balanza.set_offset(nuevo);
+  registrarTara(nuevo);
+  Serial.printf("Auto-tara: offset %ld (corrimiento %.4f kg)\n", nuevo, corrimientoKg);
+  return true;
+}
+
+// Sin sesión, sin liberación y sin pre-porción: en la cámara no hay comida dosificada
+bool camaraOciosa() {
+  return estadoActual == ESPERANDO_TARJETA && faseLiberacion == LIB_INACTIVA && !prePorcionLista;
+}
+
+// Llamado desde loop(): re-tara tras una liberación o por intervalo, solo con la cámara vacía
+void atenderAutoTara() {
+  if (!AUTO_TARA_ACTIVA) return;
+  if (!camaraOciosa() || pendientes.n > 0) return;
+  if (!autoTaraPendiente && millis() - tUltimaTara < AUTO_TARA_INTERVALO_MS) return;
+  autoTaraPendiente = false;
+  tUltimaTara = millis(); // también si falla, para no reintentar en cada loop
+  autoTarar();
+}
+
+// Antes de dosificar: si la última tara es vieja, mover el cero según el modelo de deriva
+void compensarDeriva() {
+  if (histTaraCount < 2 || millis() - tUltimaTara < DERIVA_MIN_ANTIGUEDAD_MS) return;
+  const MuestraTara &ultima = histTara[(histTaraHead + histTaraCount - 1) % HIST_TARA];
+  uint32_t dt = segundosArranque() - ultima.tSeg;
+  if (dt > DERIVA_MAX_EXTRAPOLACION_S) dt = DERIVA_MAX_EXTRAPOLACION_S;
+  balanza.set_offset(ultima.offset + (long)(derivaCuentasPorSeg * dt));
+}
+
+void saveCalibracionToNVS() {
+  prefs.begin(PREF_NAMESPACE, false);
+  if (numPuntosCal > 0) {
+    prefs.putBytes("calib", puntosCal, sizeof(PuntoCalibracion) * numPuntosCal);
+  } else {
+    prefs.remove("calib");
+  }
+  prefs.end();
+}
+
+void loadCalibracionFromNVS() {
+  prefs.begin(PREF_NAMESPACE, true);
+  size_t bytes = prefs.isKey("calib") ? prefs.getBytesLength("calib") : 0;
+  if (bytes > sizeof(puntosCal)) bytes = 0; // protección
+  if (bytes > 0) prefs.getBytes("calib", puntosCal, bytes);
+  prefs.end();
+  numPuntosCal = bytes / sizeof(PuntoCalibracion);
+  Serial.printf("Calibracion: %u puntos\n", (unsigned)numPuntosCal);
+}
+
+// Agrega (o reemplaza si el crudo es casi igual) un punto con la carga actual de 'kg'.
+// Solo desde atenderBalanzaPedida(), con la cámara ociosa.
+bool agregarPuntoCalibracion(float kg) {
+  plazoIniciar("calibPunto", 2500);
+  balanza.power_up();
+  delay(120);
+  bool lista = balanza.wait_ready_timeout(1000);
+  long cuentas = lista ? (long)balanza.get_value(10) : 0;
+  balanza.power_down();
+  plazoTerminar();
+  float crudo = (float)cuentas;
+  if (lista) traceRegistrarHx711(TRH_CALIBRACION, cuentas);
+  else Serial.println("Calibracion: HX711 sin respuesta");
+  if (!balanzaAgregarPunto(puntosCal, numPuntosCal, MAX_PUNTOS_CAL, crudo, kg)) return false;
+  saveCalibracionToNVS();
+  Serial.printf("Punto de calibracion: %.0f cuentas = %.3f kg (%u puntos)\n", crudo, kg, (unsigned)numPuntosCal);
+  return true;
+}
+
+// Llamado desde loop(): ejecuta la tara o el punto de calibración pedidos por MQTT
+// cuando ninguna sesión ni liberación usa la balanza; el ACK sale al terminar.
+void atenderBalanzaPedida() {
+  if (!taraPedida && !calibPedida && !calibResetPedido) return;
+  if (!camaraOciosa()) return;
+
+  if (taraPedida) {
+    taraPedida = false;
+    // el backend garantiza que la cámara está vacía; no se aplica el límite de deriva
+    plazoIniciar("tarar", 2500);
+    balanza.power_up();
+    delay(120);
+    bool lista = balanza.wait_ready_timeout(1000);
+    if (lista) balanza.tare();
+    balanza.power_down();
+    plazoTerminar();
+    if (lista) {
+      traceRegistrarHx711(TRH_TARA, balanza.get_offset());
+      registrarTara(balanza.get_offset());
+      sendConfigAck("tarar", "", "OK");
+    } else {
+      sendConfigAck("tarar", "", "ERROR: balanza_no_lista");
+    }
+  }
+
+  if (calibResetPedido) {
+    calibResetPedido = false;
+    numPuntosCal = 0;
+    saveCalibracionToNVS();
+    sendConfigAck("calib_reset", "", "OK");
+    solicitarSalida(SAL_BALANZA);
+  }
+
+  if (calibPedida) {
+    calibPedida = false;
+    bool ok = agregarPuntoCalibracion(calibPedidaKg);
+    sendConfigAck("calib_punto", "", ok ? "OK" : "ERROR: punto_invalido");
+    if (ok) solicitarSalida(SAL_BALANZA);
+  }
+}
+
+// Métricas del cero y de la calibración en TOPIC_BALANZA
+size_t publishBalanza() {
+  StaticJsonDocument<1024> doc;
+  doc["offset"] = balanza.get_offset();
+  doc["deriva_cuentas_h"] = derivaCuentasPorSeg * 3600.0f;
+  doc["auto_taras_rechazadas"] = autoTarasRechazadas;
+  doc["atascos"] = atascosLiberacion;
+  JsonArray hist = doc.createNestedArray("historial");
+  for (uint8_t i = 0; i < histTaraCount; i++) {
+    const MuestraTara &m = histTara[(histTaraHead + i) % HIST_TARA];
+    JsonObject o = hist.createNestedObject();
+    o["epoch"] = m.epoch;
+    o["offset"] = m.offset;
+  }
+  JsonArray cal = doc.createNestedArray("calibracion");
+  for (uint8_t i = 0; i < numPuntosCal; i++) {
+    JsonObject o = cal.createNestedObject();
+    o["crudo"] = puntosCal[i].crudo;
+    o["kg"] = puntosCal[i].kg;
+  }
+
+  char buffer[768];
+  size_t n = serializeJson(doc, buffer, sizeof(buffer));
+  if (!mqtt.publish(TOPIC_BALANZA, (const uint8_t*)buffer, n, false)) return 0;
+  Serial.println("Balanza publicada");
+  return n;
+}
+
 // ================ FUNCIONES ==============
-// Guarda mascotas y numMascotas y configVersion en NVS (Preferences)
-bool saveConfigToNVS() {
-  prefs.begin(PREF_NAMESPACE, false); // RW
+// Guarda una tabla de mascotas y su versión en NVS (Preferences).
+// Se llama desde la tarea de persistencia, por eso usa su propio Preferences.
+bool saveConfigToNVS(const Mascota* tabla, uint8_t n, uint32_t version) {
+  Preferences p;
+  p.begin(PREF_NAMESPACE, false); // RW
   // Guardar número de mascotas
-  prefs.putUShort("nmasc", numMascotas);
-  // Guardar array de mascotas (solo los numMascotas primeros)
-  if (numMascotas > 0) {
-    size_t bytes = sizeof(Mascota) * (size_t)numMascotas;
-    prefs.putBytes("masc", (const void*)mascotas, bytes);
+  p.putUShort("nmasc", n);
+  // Guardar array de mascotas (solo los n primeros)
+  if (n > 0) {
+    size_t bytes = sizeof(Mascota) * (size_t)n;
+    p.putBytes("masc", (const void*)tabla, bytes);
   } else {
     // eliminar key si no hay mascotas
-    prefs.remove("masc");
+    p.remove("masc");
   }
-  prefs.putUInt("cfgver", configVersion);
-  prefs.end();
-  Serial.printf("Guardado en NVS: numMascotas=%u cfgver=%u\n", (unsigned)numMascotas, (unsigned)configVersion);
+  p.putUInt("cfgver", version);
+  p.end();
+  Serial.printf("Guardado en NVS: numMascotas=%u cfgver=%u\n", (unsigned)n, (unsigned)version);
   return true;
 }
 
@@ -204,6 +1125,10 @@ bool loadConfigFromNVS() {
   }
   configVersion = prefs.getUInt("cfgver", 0);
   prefs.end();
+  // datos guardados antes de existir el campo traen basura en el padding
+  for (uint8_t i = 0; i < numMascotas; i++) {
+    if (mascotas[i].modoDosificacion > DOSIF_CONTINUO) mascotas[i].modoDosificacion = DOSIF_TOLVA;
+  }
   Serial.printf("Cargado NVS: numMascotas=%u cfgver=%u\n", (unsigned)numMascotas, (unsigned)configVersion);
   // debug: listar nombres
   for (uint8_t i = 0; i < numMascotas; i++) {
@@ -214,80 +1139,184 @@ bool loadConfigFromNVS() {
   return true;
 }
 
-// incrementa version y guarda en NVS (llamar después de modificar)
-void bumpConfigVersionAndSave() {
-  configVersion++;
-  saveConfigToNVS();
+// ---------------- Snapshots de configuración ----------------
+// Bits de notificación de la tarea de persistencia
+#define PERSISTIR_TABLA  0x01
+#define PERSISTIR_PARAMS 0x02
+
+static SemaphoreHandle_t mutexConfig = nullptr;   // protege el cambio de tabla activa y la copia de parámetros
+static TaskHandle_t tareaPersistenciaHandle = nullptr;
+static Mascota copiaPersistencia[MAX_MASCOTAS];
+static uint32_t copiaParamsPersistencia[NUM_PARAMETROS];
+
+int buscarEnTabla(const Mascota* tabla, uint8_t n, const byte* uid) {
+  for (int i = 0; i < n; i++) {
+    if (memcmp(tabla[i].uid, uid, UID_SIZE) == 0) return i;
+  }
+  return -1;
 }
 
-// Enviar ACK simple por MQTT (topic TOPIC_CONFIG_ACK)
-void sendConfigAck(const char* action, const char* uidStr, const char* status) {
-  // construir json sencillo
-  char buf[128];
-  int n = snprintf(buf, sizeof(buf),
-                   "{\"action\":\"%s\",\"uid\":\"%s\",\"status\":\"%s\",\"config_version\":%u}",
-                   action, uidStr ? uidStr : "", status, (unsigned)configVersion);
-  if (n > 0 && n < (int)sizeof(buf)) {
-    if (!mqtt.connected()) {
-      conectarMQTT(); // intentar reconectar
-    }
-    if (mqtt.connected()) {
-      mqtt.publish(TOPIC_CONFIG_ACK, buf, false);
-      Serial.print("ACK enviado: ");
-      Serial.println(buf);
-    } else {
-      Serial.println("No conectado: ACK no enviado");
-    }
-  } else {
-    Serial.println("ACK: buffer overflow");
+// Tabla donde escriben los comandos de config. La primera escritura tras una
+// publicación la inicia como copia de la activa; las siguientes se acumulan.
+Mascota* tablaSiguiente() {
+  Mascota* sig = tablasMascotas[tablaActiva ^ 1];
+  if (!configPendiente) {
+    memcpy(sig, mascotas, sizeof(Mascota) * numMascotas);
+    numMascotasSiguiente = numMascotas;
+    configVersionSiguiente = configVersion;
+    configPendiente = true;
   }
+  return sig;
 }
 
-// Publicar estado/config_version al reconectar para que Node-RED decida sincronizar
-void publishConfigStatus() {
-  char buf[64];
-  int n = snprintf(buf, sizeof(buf), "{\"config_version\":%u}", (unsigned)configVersion);
-  if (n>0 && n < (int)sizeof(buf)) {
-    if (mqtt.connected()) {
-      mqtt.publish(TOPIC_CONFIG_STATUS, buf, false);
-      Serial.print("Status publicado: "); Serial.println(buf);
+// Versión que verá el backend una vez aplicados los cambios ya confirmados
+uint32_t configVersionConfirmada() {
+  return configPendiente ? configVersionSiguiente : configVersion;
+}
+
+// Guarda en NVS la tabla activa y los parámetros fuera del loop: copia bajo el
+// mutex y escribe después
+void tareaPersistencia(void* arg) {
+  (void)arg;
+  uint32_t blob[NUM_PARAMETROS];
+  while (true) {
+    uint32_t pedidos = 0;
+    xTaskNotifyWait(0, 0xFFFFFFFF, &pedidos, portMAX_DELAY);
+    if (pedidos & PERSISTIR_TABLA) {
+      xSemaphoreTake(mutexConfig, portMAX_DELAY);
+      uint8_t n = numMascotas;
+      uint32_t version = configVersion;
+      memcpy(copiaPersistencia, mascotas, sizeof(Mascota) * n);
+      xSemaphoreGive(mutexConfig);
+      saveConfigToNVS(copiaPersistencia, n, version);
+    }
+    if (pedidos & PERSISTIR_PARAMS) {
+      xSemaphoreTake(mutexConfig, portMAX_DELAY);
+      memcpy(blob, copiaParamsPersistencia, sizeof(blob));
+      xSemaphoreGive(mutexConfig);
+      saveParamsToNVS(blob);
     }
   }
 }
 
-void publishMascotas() {
-  StaticJsonDocument<512> doc;
-
-  doc["config_version"] = configVersion;
-  JsonArray arr = doc.createNestedArray("mascotas");
+// Llamado desde loop(): copia los parámetros marcados por set_param y pide a
+// la tarea de persistencia que los escriba
+void guardarParamsPendientes() {
+  if (!paramsPendientes || !tareaPersistenciaHandle) return;
+  paramsPendientes = false;
+  xSemaphoreTake(mutexConfig, portMAX_DELAY);
+  armarBlobParametros(copiaParamsPersistencia);
+  xSemaphoreGive(mutexConfig);
+  xTaskNotify(tareaPersistenciaHandle, PERSISTIR_PARAMS, eSetBits);
+}
 
-  for (uint8_t i = 0; i < numMascotas; i++) {
-    JsonObject m = arr.createNestedObject();
+void iniciarPersistencia() {
+  mutexConfig = xSemaphoreCreateMutex();
+  // núcleo 0: el loop de Arduino corre en el 1
+  xTaskCreatePinnedToCore(tareaPersistencia, "persistencia", 4096, nullptr, 1, &tareaPersistenciaHandle, 0);
+}
 
-    char uidStr[UID_STR_LEN];
-    uidToString(mascotas[i].uid, uidStr, sizeof(uidStr));
+// Publica la tabla armada si ninguna sesión tiene fijada la actual. Las marcas
+// yaAlimentoHoy se copian de la tabla activa para ventanas que no cambiaron.
+void publicarConfigPendiente() {
+  if (!configPendiente) return;
+  if (estadoActual != ESPERANDO_TARJETA && estadoActual != LIBERANDO) return;
+
+  Mascota* sig = tablasMascotas[tablaActiva ^ 1];
+  uint16_t gramosSiguiente[MAX_MASCOTAS];
+  for (uint8_t i = 0; i < numMascotasSiguiente; i++) {
+    int anterior = buscarEnTabla(mascotas, numMascotas, sig[i].uid);
+    gramosSiguiente[i] = (anterior >= 0) ? gramosHoy[anterior] : 0;
+    for (uint8_t j = 0; j < sig[i].numVentanas; j++) {
+      VentanaHoraria &v = sig[i].ventanas[j];
+      v.yaAlimentoHoy = false;
+      if (anterior < 0) continue;
+      const Mascota &m = mascotas[anterior];
+      for (uint8_t k = 0; k < m.numVentanas; k++) {
+        if (m.ventanas[k].inicio == v.inicio && m.ventanas[k].fin == v.fin) {
+          v.yaAlimentoHoy = m.ventanas[k].yaAlimentoHoy;
+          break;
+        }
+      }
+    }
+  }
 
-    m["uid"] = uidStr;
-    m["nombre"] = mascotas[i].nombre;
-    m["pesoObjetivoKg"] = mascotas[i].pesoObjetivoKg;
+  xSemaphoreTake(mutexConfig, portMAX_DELAY);
+  tablaActiva ^= 1;
+  mascotas = tablasMascotas[tablaActiva];
+  numMascotas = numMascotasSiguiente;
+  configVersion = configVersionSiguiente;
+  configPendiente = false;
+  xSemaphoreGive(mutexConfig);
+  memcpy(gramosHoy, gramosSiguiente, sizeof(gramosSiguiente));
+
+  if (tareaPersistenciaHandle) xTaskNotify(tareaPersistenciaHandle, PERSISTIR_TABLA, eSetBits);
+  Serial.printf("Config publicada: version %u, numMascotas=%u\n", (unsigned)configVersion, (unsigned)numMascotas);
+}
 
-    JsonArray vArr = m.createNestedArray("ventanas");
-    for (uint8_t j = 0; j < mascotas[i].numVentanas; j++) {
-      JsonObject v = vArr.createNestedObject();
-      v["inicio"] = mascotas[i].ventanas[j].inicio;
-      v["fin"] = mascotas[i].ventanas[j].fin;
-    }
+// Encolar ACK simple en el carril de control (topic TOPIC_CONFIG_ACK)
+void sendConfigAck(const char* action, const char* uidStr, const char* status) {
+  // construir json sencillo
+  char buf[CONTROL_MSG_LEN];
+  int n = snprintf(buf, sizeof(buf),
+                   "{\"action\":\"%s\",\"uid\":\"%s\",\"status\":\"%s\",\"config_version\":%u}",
+                   action, uidStr ? uidStr : "", status, (unsigned)configVersionConfirmada());
+  if (n > 0 && n < (int)sizeof(buf)) {
+    encolarControl(buf);
+  } else {
+    Serial.println("ACK: buffer overflow");
   }
+}
 
-  char buffer[512];
-  size_t n = serializeJson(doc, buffer);
+// Publicar estado/config_version al reconectar para que Node-RED decida sincronizar
+size_t publishConfigStatus() {
+  actualizarCacheRespuestas();
+  if (!mqtt.publish(TOPIC_CONFIG_STATUS, cacheStatus, false)) return 0;
+  Serial.print("Status publicado: "); Serial.println(cacheStatus);
+  return cacheStatusLen;
+}
 
-  mqtt.publish(TOPIC_MASCOTAS, buffer, n);
+size_t publishMascotas() {
+  actualizarCacheRespuestas();
+  if (!mqtt.publish(TOPIC_MASCOTAS, cacheMascotas, false)) return 0;
   Serial.println("Mascotas publicadas");
+  return cacheMascotasLen;
+}
+
+// Publica el parámetro pedido, o el siguiente si se pidieron todos, con sus
+// límites: {"params":{"nombre":{...}}}. Uno por mensaje para que el tamaño no
+// crezca con el registro; 'fin' = ya salió el último.
+size_t publishParametros(bool &fin) {
+  uint8_t i = (paramPedido >= 0) ? paramPedido : paramCursor;
+  fin = true;
+  if (i >= NUM_PARAMETROS) return 0;
+  const Parametro &p = parametros[i];
+
+  StaticJsonDocument<256> doc;
+  JsonObject po = doc.createNestedObject("params").createNestedObject(p.nombre);
+  if (p.tipo == PARAM_ULONG) {
+    po["valor"] = *(unsigned long*)p.valor;
+  } else {
+    po["valor"] = *(float*)p.valor;
+  }
+  po["min"] = p.minimo;
+  po["max"] = p.maximo;
+  po["default"] = p.defecto;
+
+  char buffer[192];
+  size_t n = serializeJson(doc, buffer, sizeof(buffer));
+
+  fin = false;
+  if (!mqtt.publish(TOPIC_PARAMS, (const uint8_t*)buffer, n, false)) return 0;
+  if (paramPedido < 0 && ++paramCursor < NUM_PARAMETROS) return n;
+  fin = true;
+  Serial.println("Parametros publicados");
+  return n;
 }
 
 
 void conectarWiFi() {
+  plazoIniciar("conectarWiFi", 17000);
   WiFi.disconnect(true);
   delay(1000);
   WiFi.mode(WIFI_STA);
@@ -302,6 +1331,7 @@ void conectarWiFi() {
     delay(500);
     Serial.print(".");
     intentos++;
+    alimentarWatchdog(); // espera acotada a 15 s
   }
 
   if (WiFi.status() == WL_CONNECTED) {
@@ -311,23 +1341,102 @@ void conectarWiFi() {
   } else {
     Serial.println("\nERROR: No se pudo conectar al WiFi");
   }
+  plazoTerminar();
+}
+
+
+// ================ RELOJ ===================
+// Reloj de pared anclado a esp_timer: cada sincronización NTP fija un par
+// (epoch, esp_timer) y las lecturas posteriores son aritmética entera, sin
+// getLocalTime() ni conversiones de zona. La hora local es epoch + offset fijo.
+#define GMT_OFFSET_S (-5 * 3600)   // Ecuador GMT-5
+#define DST_OFFSET_S 0             // sin horario de verano
+
+const unsigned long RELOJ_RESYNC_MS = 3600000; // re-anclar al reloj del sistema cada hora
+
+static uint32_t relojAnclaEpoch = 0;   // epoch UTC en el instante del ancla
+static int64_t relojAnclaUs = 0;       // esp_timer_get_time() en el instante del ancla
+static unsigned long tUltimoAncla = 0;
+static volatile bool relojSyncPendiente = false;
+static void (*relojAlCambiarDia)(int32_t dia) = nullptr;
+
+bool relojValido() {
+  return relojAnclaEpoch >= EPOCH_VALIDO_MIN;
+}
+
+// Epoch UTC actual estimado desde el último ancla
+uint32_t relojEpoch() {
+  if (!relojValido()) return 0;
+  return relojEpochDesdeAncla(relojAnclaEpoch, relojAnclaUs, esp_timer_get_time());
+}
+
+// Epoch desplazado a hora local
+uint32_t relojEpochLocal() {
+  return relojALocal(relojEpoch(), GMT_OFFSET_S, DST_OFFSET_S);
+}
+
+// Número de día local desde 1970 (-1 si no hay hora)
+int32_t relojDia() {
+  if (!relojValido()) return -1;
+  return relojDiaLocal(relojEpochLocal());
+}
+
+// Toma el reloj del sistema (que SNTP mantiene) como nuevo ancla y reporta la deriva
+void relojAnclar() {
+  time_t ahora = time(nullptr);
+  if ((unsigned long)ahora < EPOCH_VALIDO_MIN) return;
+
+  if (relojValido()) {
+    int32_t deriva = (int32_t)((uint32_t)ahora - relojEpoch());
+    if (deriva != 0) Serial.printf("Reloj: deriva corregida %ld s\n", (long)deriva);
+  }
+  relojAnclaUs = esp_timer_get_time();
+  relojAnclaEpoch = (uint32_t)ahora;
+  tUltimoAncla = millis();
+}
+
+// Llamado desde la tarea de SNTP: solo marca, el ancla se toma en loop()
+void relojOnSntpSync(struct timeval *tv) {
+  (void)tv;
+  relojSyncPendiente = true;
 }
 
+// Re-ancla si hubo sync o pasó el intervalo, y dispara el callback de cambio de día
+void relojActualizar() {
+  if (relojSyncPendiente || (relojValido() && millis() - tUltimoAncla >= RELOJ_RESYNC_MS)) {
+    relojSyncPendiente = false;
+    relojAnclar();
+  }
+
+  relojNotificarDia(relojDia(), ultimoDia, relojAlCambiarDia);
+}
 
 void configurarHora() {
-  configTime(-5 * 3600, 0, "pool.ntp.org"); // Ecuador GMT-5
+  sntp_set_time_sync_notification_cb(relojOnSntpSync);
+  configTime(GMT_OFFSET_S, DST_OFFSET_S, "pool.ntp.org");
+  plazoIniciar("configurarHora", 10000);
 
   struct tm timeinfo;
   Serial.print("Sincronizando hora");
-  while (!getLocalTime(&timeinfo)) {
+  int intentos = 0;
+  while (!getLocalTime(&timeinfo, 500) && intentos < 16) {
     Serial.print(".");
-    delay(500);
+    intentos++;
+    alimentarWatchdog(); // espera acotada a ~8 s
   }
 
-  Serial.println("\nHora sincronizada");
+  relojAnclar(); // no ancla si todavía no hay hora
+  if (relojValido()) {
+    Serial.println("\nHora sincronizada");
+  } else {
+    // sin hora se sigue arrancando; el callback de SNTP ancla el reloj al llegar
+    Serial.println("\nSin hora NTP, se sincroniza en segundo plano");
+  }
+  plazoTerminar();
 }
 
 bool conectarMQTT() {
+  plazoIniciar("conectarMQTT", 3000);
   mqtt.setServer(MQTT_BROKER, MQTT_PORT);
 
   Serial.print("Conectando a MQTT...");
@@ -335,16 +1444,21 @@ bool conectarMQTT() {
     Serial.println(" conectado");
     // Suscribirse al topic de configuración al reconectar
     mqtt.subscribe(TOPIC_CONFIG);
+    mqtt.subscribe(TOPIC_EVENTOS_ACK);
+    // lo publicado antes de la desconexión pudo perderse: reenviar sin esperar ACK
+    colaEnviados = 0;
     // al reconectar, publicar estado para que el servidor sepa qué versión tiene este dispositivo
-    publishConfigStatus();
-    publishMascotas();
+    solicitarSalida(SAL_CONFIG_STATUS);
+    solicitarSalida(SAL_MASCOTAS);
 
     Serial.print("Suscrito a: ");
     Serial.println(TOPIC_CONFIG);
+    plazoTerminar();
     return true;
   } else {
     Serial.print(" fallo, rc=");
     Serial.println(mqtt.state());
+    plazoTerminar();
     return false;
   }
 }
@@ -361,15 +1475,8 @@ bool uidStringToBytes(const char* uidStr, byte* uidOut) {
   return true;
 }
 
-int buscarMascota(byte *uid) {
-  for (int i = 0; i < numMascotas; i++) {
-    bool igual = true;
-    for (int j = 0; j < UID_SIZE; j++) {
-      if (mascotas[i].uid[j] != uid[j]) { igual = false; break; }
-    }
-    if (igual) return i;
-  }
-  return -1;
+int buscarMascota(const byte *uid) {
+  return buscarEnTabla(mascotas, numMascotas, uid);
 }
 
 int buscarMascotaPorUIDStr(const char* uidStr) {
@@ -378,23 +1485,134 @@ int buscarMascotaPorUIDStr(const char* uidStr) {
   return buscarMascota(uidTmp);
 }
 
-const char* nombrePorUID(const char* uidStr) {
-  for (int i = 0; i < numMascotas; i++) {
-    char uidMascota[UID_STR_LEN];
-    snprintf(uidMascota, UID_STR_LEN, "%02X:%02X:%02X:%02X",
-             mascotas[i].uid[0], mascotas[i].uid[1],
-             mascotas[i].uid[2], mascotas[i].uid[3]);
-    if (strcmp(uidStr, uidMascota) == 0) {
-      return mascotas[i].nombre;
+const char* nombrePorUID(const byte* uid) {
+  int idx = buscarMascota(uid);
+  if (idx < 0) return "DESCONOCIDO";
+  return mascotas[idx].nombre;
+}
+
+uint16_t horaActualMin() {
+  if (!relojValido()) return 0;
+  return relojMinutoDelDia(relojEpochLocal());
+}
+
+bool dentroDeVentana(const VentanaHoraria &v, uint16_t hora) {
+  if (v.inicio <= v.fin) return (hora >= v.inicio && hora <= v.fin);
+  return (hora >= v.inicio || hora <= v.fin);
+}
+
+// ================ CACHE DE RESPUESTAS =====
+// get_mascotas y el status se publican desde buffers ya serializados. Solo se
+// rearman si cambió configVersion (upsert/delete publicado), si hubo una comida
+// o cambio de día (generacionRespuestas) o si el reloj cruzó un inicio/fin de
+// ventana, que es lo que mueve "proxima_ventana".
+#define MINUTOS_DIA 1440
+
+static bool cacheValido = false;
+static uint32_t cacheVersion = 0;
+static uint32_t cacheGeneracion = 0;
+static uint32_t cacheVenceMin = 0;   // minuto local absoluto (epoch / 60) del próximo borde
+
+// Ventana en curso sin comer o, si no, la próxima en empezar (puede ser mañana)
+int proximaVentana(const Mascota &m, uint16_t hora) {
+  int mejor = -1;
+  uint16_t mejorEspera = MINUTOS_DIA + 1;
+  for (uint8_t i = 0; i < m.numVentanas; i++) {
+    const VentanaHoraria &v = m.ventanas[i];
+    if (dentroDeVentana(v, hora) && !v.yaAlimentoHoy) return i;
+    uint16_t espera = (v.inicio + MINUTOS_DIA - hora) % MINUTOS_DIA;
+    if (espera == 0) espera = MINUTOS_DIA;
+    if (espera < mejorEspera) { mejorEspera = espera; mejor = i; }
+  }
+  return mejor;
+}
+
+// Minutos hasta el próximo inicio o fin de ventana de cualquier mascota
+uint16_t minutosHastaBorde(uint16_t hora) {
+  uint16_t minimo = MINUTOS_DIA;
+  for (uint8_t i = 0; i < numMascotas; i++) {
+    for (uint8_t j = 0; j < mascotas[i].numVentanas; j++) {
+      const VentanaHoraria &v = mascotas[i].ventanas[j];
+      uint16_t bordes[2] = {v.inicio, (uint16_t)((v.fin + 1) % MINUTOS_DIA)};
+      for (uint8_t k = 0; k < 2; k++) {
+        uint16_t d = (bordes[k] + MINUTOS_DIA - hora) % MINUTOS_DIA;
+        if (d == 0) d = MINUTOS_DIA;
+        if (d < minimo) minimo = d;
+      }
     }
   }
-  return "DESCONOCIDO";
+  return minimo;
 }
 
-uint16_t horaActualMin() {
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) return 0;
-  return timeinfo.tm_hour * 60 + timeinfo.tm_min;
+void construirCacheRespuestas(uint16_t hora) {
+  StaticJsonDocument<2048> doc;
+  uint8_t alimentadas = 0;
+  uint32_t gramosTotal = 0;
+
+  doc["config_version"] = configVersion;
+  JsonArray arr = doc.createNestedArray("mascotas");
+
+  for (uint8_t i = 0; i < numMascotas; i++) {
+    const Mascota &mascota = mascotas[i];
+    JsonObject m = arr.createNestedObject();
+
+    char uidStr[UID_STR_LEN];
+    uidToString(mascota.uid, uidStr, sizeof(uidStr));
+
+    m["uid"] = uidStr;
+    m["nombre"] = mascota.nombre;
+    m["pesoObjetivoKg"] = mascota.pesoObjetivoKg;
+    if (mascota.modoDosificacion == DOSIF_PULSOS) m["dosificacion"] = "pulsos";
+    else if (mascota.modoDosificacion == DOSIF_CONTINUO) m["dosificacion"] = "continuo";
+
+    bool alimentada = false;
+    JsonArray vArr = m.createNestedArray("ventanas");
+    for (uint8_t j = 0; j < mascota.numVentanas; j++) {
+      JsonObject v = vArr.createNestedObject();
+      v["inicio"] = mascota.ventanas[j].inicio;
+      v["fin"] = mascota.ventanas[j].fin;
+      if (mascota.ventanas[j].yaAlimentoHoy) alimentada = true;
+    }
+
+    // derivados: se calculan una vez por reconstrucción, no por consulta
+    m["alimentada_hoy"] = alimentada;
+    m["gramos_hoy"] = gramosHoy[i];
+    int p = proximaVentana(mascota, hora);
+    if (p >= 0) {
+      JsonObject pv = m.createNestedObject("proxima_ventana");
+      pv["inicio"] = mascota.ventanas[p].inicio;
+      pv["fin"] = mascota.ventanas[p].fin;
+    }
+    if (alimentada) alimentadas++;
+    gramosTotal += gramosHoy[i];
+  }
+
+  if (doc.overflowed()) Serial.println("WARN: listado de mascotas truncado");
+  cacheMascotasLen = serializeJson(doc, cacheMascotas, sizeof(cacheMascotas));
+
+  int n = snprintf(cacheStatus, sizeof(cacheStatus),
+                   "{\"config_version\":%u,\"mascotas\":%u,\"alimentadas_hoy\":%u,\"gramos_hoy\":%lu}",
+                   (unsigned)configVersion, (unsigned)numMascotas, (unsigned)alimentadas,
+                   (unsigned long)gramosTotal);
+  cacheStatusLen = (n > 0 && n < (int)sizeof(cacheStatus)) ? n : 0;
+}
+
+// Rearma los buffers solo si algo de lo que muestran pudo cambiar
+void actualizarCacheRespuestas() {
+  uint32_t ahoraMin = relojValido() ? relojEpochLocal() / 60 : 0;
+  if (cacheValido && cacheVersion == configVersion && cacheGeneracion == generacionRespuestas &&
+      (int32_t)(ahoraMin - cacheVenceMin) < 0) {
+    return;
+  }
+
+  uint16_t hora = horaActualMin();
+  construirCacheRespuestas(hora);
+  cacheValido = true;
+  cacheVersion = configVersion;
+  cacheGeneracion = generacionRespuestas;
+  cacheVenceMin = ahoraMin + minutosHastaBorde(hora);
+  Serial.printf("Cache de respuestas rearmada: version %u, %u bytes\n",
+                (unsigned)configVersion, (unsigned)cacheMascotasLen);
 }
 
 ResultadoValidacion validarVentana(
@@ -432,54 +1650,430 @@ ResultadoValidacion validarVentana(
   }
 }
 
+// ---------- RFID: caché de vistos y cola de pendientes ----------
+void encolarRechazosAgrupados(UIDVisto &c);
+
+UIDVisto* buscarVisto(const byte* uid) {
+  return buscarEnVistos(uidsVistos, uid);
+}
+
+// Devuelve la entrada del UID, creándola sobre una libre o la más vieja
+UIDVisto& obtenerVisto(const byte* uid) {
+  UIDVisto* existente = buscarVisto(uid);
+  if (existente) return *existente;
+  // al pisar una entrada se emiten sus repeticiones pendientes
+  UIDVisto &c = obtenerEnVistos(uidsVistos, uid, millis(), RFID_VISTO_TTL_MS, encolarRechazosAgrupados);
+  c.rechazo = RECHAZO_NINGUNO;
+  return c;
+}
+
+void agregarPendiente(const byte* uid) {
+  if (encolarTarjeta(pendientes, uid, millis(), obtenerVisto) == TARJETA_COLA_LLENA) {
+    Serial.println("WARN: cola de pendientes llena, tarjeta ignorada");
+  }
+}
+
+// Adaptador del MFRC522 para escanearLector (lib/Pendientes)
+struct LectorMFRC522 {
+  MFRC522 &rc;
+  bool nuevaTarjeta() { return rc.PICC_IsNewCardPresent(); }
+  bool leerUid() { return rc.PICC_ReadCardSerial(); }
+  const byte* uid() const { return rc.uid.uidByte; }
+  uint8_t uidSize() const { return rc.uid.size; }
+  void detener() { rc.PICC_HaltA(); }
+  void finalizar() { rc.PCD_StopCrypto1(); }
+};
+
+// Lee todas las tarjetas presentes y las agrega a la cola de pendientes.
+// Devuelve cuántas tarjetas respondieron.
+uint8_t escanearTarjetas() {
+  LectorMFRC522 lector = {mfrc522};
+  return escanearLector(lector, RFID_MAX_POR_ESCANEO, [](const byte* uid, uint8_t size) {
+    traceRegistrar(TR_RFID, size, empaquetarUID(uid));
+    agregarPendiente(uid);
+  });
+}
+
+void atenderControl();
+
+// Desde los lazos de dosificación, que bloquean loop(): MQTT (con los ACKs de
+// lo que llegue) y, durante una pre-porción, las tarjetas que llegan quedan en
+// la cola de pendientes
+void atenderDuranteDosis() {
+  mqtt.loop();
+  atenderControl();
+  if (escanearEnDosis) escanearTarjetas();
+}
+
+// 2: registrada con ventana abierta y sin comer, 1: registrada, 0: desconocida
+uint8_t prioridadPendiente(const Pendiente &p, uint16_t hora) {
+  int idx = buscarMascota(p.uid);
+  if (idx < 0) return 0;
+  int ventana;
+  return (validarVentana(mascotas[idx], hora, ventana) == VALIDACION_OK) ? 2 : 1;
+}
+
+// Saca de la cola la pendiente de mayor prioridad (a igual prioridad, la más antigua)
+bool tomarPendiente(byte* uidOut) {
+  pendientes.purgar(millis(), PENDIENTE_TTL_MS);
+  if (pendientes.n == 0) return false;
+  uint16_t hora = horaActualMin();
+  return pendientes.tomar([hora](const Pendiente &p) { return prioridadPendiente(p, hora); }, uidOut);
+}
+
 // ---------- SERVOS (MOVIMIENTO SUAVE) ----------
 void abrirPuerta1Lento() {
-  for (int angulo = 90; angulo >= 45; angulo--) {
+  traceRegistrar(TR_SERVO, 1, PUERTA1_ABIERTA);
+  for (int angulo = PUERTA1_CERRADA; angulo >= PUERTA1_ABIERTA; angulo--) {
     servoPuerta1.write(angulo);
-    delay(10);   // 
+    delay(PUERTA1_PASO_MS);
   }
 }
 
 void cerrarPuerta1Lento() {
-  for (int angulo = 45; angulo <= 90; angulo++) {
+  traceRegistrar(TR_SERVO, 1, PUERTA1_CERRADA);
+  for (int angulo = PUERTA1_ABIERTA; angulo <= PUERTA1_CERRADA; angulo++) {
     servoPuerta1.write(angulo);
-    delay(10);
+    delay(PUERTA1_PASO_MS);
   }
 }
 
-void abrirPuerta2()  { servoPuerta2.write(135); }
-void cerrarPuerta2() { servoPuerta2.write(45); }
+void abrirPuerta2()  { traceRegistrar(TR_SERVO, 2, 135); servoPuerta2.write(135); }
+void cerrarPuerta2() { traceRegistrar(TR_SERVO, 2, 45); servoPuerta2.write(45); }
 
 float leerPesoKg() {
-  float peso= balanza.get_units(10);
+  plazoIniciar("leerPesoKg", 1500);
+  long cuentas = (long)balanza.get_value(10);
+  plazoTerminar();
+  traceRegistrarHx711(TRH_PROMEDIO, cuentas);
+  float peso = kgDesdeCrudo((float)cuentas);
   if (abs(peso) < ZONA_MUERTA_G) peso = 0.0;
   peso = round(peso * 10.0) / 10.0;
 
-  return peso; // promedio 10 muestras
+  return peso; // promedio 10 muestras
+}
+
+void imprimirUID(byte *uid) {
+  Serial.print("UID leído: ");
+  for (byte i = 0; i < UID_SIZE; i++) {
+    Serial.print("0x");
+    if (uid[i] < 0x10) Serial.print("0");
+    Serial.print(uid[i], HEX);
+    if (i < UID_SIZE - 1) Serial.print(", ");
+  }
+  Serial.println();
+}
+
+void activarServos() {
+  servoPuerta1.attach(SERVO_PUERTA1, 500, 2400);
+  servoPuerta2.attach(SERVO_PUERTA2, 500, 2400);
+  cerrarPuerta1Lento();
+  cerrarPuerta2();
+  delay(50);
+}
+
+void desactivarServos() {
+  servoPuerta1.detach();
+  servoPuerta2.detach();
+}
+
+// Solo puerta 2: para liberar una porción ya pesada sin mover puerta 1
+void activarServoPuerta2() {
+  servoPuerta2.attach(SERVO_PUERTA2, 500, 2400);
+  cerrarPuerta2();
+}
+
+// Abre puerta 2 y deja que atenderLiberacion() la cierre sin bloquear el loop.
+// La balanza queda encendida durante la liberación para detectar la cámara vacía.
+void iniciarLiberacion(const byte* uid) {
+  memcpy(uidLiberacion, uid, UID_SIZE);
+  balanza.power_up();
+  abrirPuerta2();
+  faseLiberacion = LIB_ABIERTA;
+  tFaseLiberacion = millis();
+  tInicioLiberacion = tFaseLiberacion;
+  liberacionIniciar(liberacion, tFaseLiberacion);
+}
+
+bool liberacionEnCurso() {
+  return faseLiberacion != LIB_INACTIVA;
+}
+
+// Pulsos de puerta 1 hasta que la cámara llegue al objetivo o pasen 'presupuestoMs'.
+// Requiere servos activos y balanza encendida. Devuelve el último peso leído.
+float dosificarHasta(float objetivo, float pesoInicial, unsigned long presupuestoMs) {
+  float peso = pesoInicial;
+  if (peso >= (objetivo - MARGEN_CORTE_ANTICIPADO_KG)) return peso;
+
+  unsigned long tInicio = millis();
+
+  while (true) {
+    alimentarWatchdog(); // el bucle está acotado por presupuestoMs
+    if (!mqtt.connected()) {
+      Serial.println("MQTT desconectado durante dosificación, intentando reconectar...");
+      conectarMQTT();
+    }
+    atenderDuranteDosis();
+
+    abrirPuerta1Lento();
+    delay(TIEMPO_ABIERTO_MS);
+    cerrarPuerta1Lento();
+
+    atenderDuranteDosis();
+    delay(TIEMPO_ESTABLE_MS);
+
+    peso = leerPesoKg();
+    Serial.print("Peso: ");
+    Serial.println(peso, 3);
+
+    if (peso >= (objetivo - MARGEN_CORTE_ANTICIPADO_KG)) {
+      Serial.println("Peso objetivo alcanzado.");
+      break;
+    }
+    if (millis() - tInicio > presupuestoMs) {
+      Serial.println("Timeout de dosificación.");
+      break;
+    }
+  }
+  return peso;
+}
+
+// ---------- Dosificación continua ----------
+// Puerta 1 queda entreabierta y su ángulo sigue al caudal medido en vivo: el
+// caudal buscado es lo que falta / CONT_TAU_S, y la apertura se obtiene del
+// caudal por unidad de apertura aprendido. Se cierra cuando lo que falta es
+// igual a la masa en vuelo prevista (caudal * latencia de caída). Los cálculos
+// del lazo están en lib/Dosificacion.
+const unsigned long CONT_TIMEOUT_LECTURA_MS = 500;
+
+float latenciaCaidaS = 0.4;              // se ajusta tras cada dosis continua
+float caudalPorAperturaKgS = 0.03;       // kg/s con la puerta totalmente abierta (se aprende)
+
+// Estado de arranque del lazo en la traza: con él y las lecturas TRH_CONTINUO
+// la dosis se puede reproducir fuera del equipo (test_trace_replay)
+void traceInicioDosis(float objetivo, float pesoInicial, unsigned long tInicio) {
+  traceRegistrarFloat(TR_DOSIS, TRD_OBJETIVO, objetivo, tInicio);
+  traceRegistrarFloat(TR_DOSIS, TRD_LATENCIA, latenciaCaidaS, tInicio);
+  traceRegistrarFloat(TR_DOSIS, TRD_CAUDAL, caudalPorAperturaKgS, tInicio);
+  traceRegistrarFloat(TR_DOSIS, TRD_PESO_INICIAL, pesoInicial, tInicio);
+}
+
+// 'timeout' = se cortó por 'presupuestoMs' y no por alcanzar el objetivo
+float dosificarContinuo(float objetivo, float pesoInicial, unsigned long presupuestoMs, bool &timeout) {
+  timeout = false;
+  if (pesoInicial >= (objetivo - MARGEN_CORTE_ANTICIPADO_KG)) return pesoInicial;
+
+  unsigned long tInicio = millis();
+  unsigned long tPrevio = tInicio;
+  DosisContinua dosis;
+  dosisIniciar(dosis, objetivo, pesoInicial);
+  traceInicioDosis(objetivo, pesoInicial, tInicio);
+
+  while (true) {
+    alimentarWatchdog();
+    atenderDuranteDosis();
+
+    if (dosisDebeCortar(dosis, latenciaCaidaS, MARGEN_CORTE_ANTICIPADO_KG)) break;
+    if (millis() - tInicio > presupuestoMs) { timeout = true; break; }
+
+    int previo = dosis.angulo;
+    int angulo = dosisAngulo(dosis, caudalPorAperturaKgS);
+    if (angulo != previo) {
+      servoPuerta1.write(angulo);
+      traceRegistrar(TR_SERVO, 1, angulo);
+    }
+
+    // a 10 SPS una muestra marca el período del lazo (~100 ms); lectura de 1
+    // muestra, sin redondeo
+    if (!balanza.wait_ready_timeout(CONT_TIMEOUT_LECTURA_MS)) continue;
+    long cuentas = (long)balanza.get_value(1);
+    unsigned long ahora = millis();
+    traceRegistrarHx711(TRH_CONTINUO, cuentas, ahora);
+    float dt = (ahora - tPrevio) / 1000.0f;
+    tPrevio = ahora;
+    caudalPorAperturaKgS = dosisMedir(dosis, kgDesdeCrudo((float)cuentas), dt, caudalPorAperturaKgS,
+                                      latenciaCaidaS);
+  }
+
+  servoPuerta1.write(PUERTA1_CERRADA);
+  traceRegistrar(TR_SERVO, 1, 90);
+  delay(TIEMPO_ESTABLE_MS);
+  float peso = leerPesoKg();
+  Serial.printf("Continuo: peso %.3f kg en %lu ms\n", peso, millis() - tInicio);
+
+  // masa en vuelo real -> corregir la latencia usada para cortar
+  if (!timeout && balanza.wait_ready_timeout(CONT_TIMEOUT_LECTURA_MS)) {
+    long cuentas = (long)balanza.get_value(5);
+    traceRegistrarHx711(TRH_CORTE, cuentas);
+    latenciaCaidaS = corregirLatencia(latenciaCaidaS, kgDesdeCrudo((float)cuentas), dosis.pesoAlCorte, dosis.caudalAlCorte);
+  }
+  if (timeout) Serial.println("Timeout de dosificación.");
+  return peso;
+}
+
+// Dosifica con el modo dado; si el continuo se queda corto, completa con pulsos.
+// TIMEOUT_DOSIFICACION_MS cubre la dosis entera: los pulsos solo tienen lo que
+// dejó el continuo, y si no queda nada no se completa.
+float dosificar(float objetivo, float pesoInicial, uint8_t modo) {
+  if (modo == DOSIF_TOLVA) modo = (uint8_t)MODO_DOSIFICACION_TOLVA;
+  if (modo != DOSIF_CONTINUO) return dosificarHasta(objetivo, pesoInicial, TIMEOUT_DOSIFICACION_MS);
+  unsigned long tInicio = millis();
+  bool timeout;
+  float peso = dosificarContinuo(objetivo, pesoInicial, TIMEOUT_DOSIFICACION_MS, timeout);
+  unsigned long usado = millis() - tInicio;
+  if (timeout || usado >= TIMEOUT_DOSIFICACION_MS) return peso;
+  return dosificarHasta(objetivo, peso, TIMEOUT_DOSIFICACION_MS - usado);
+}
+
+// Minutos hasta que la mascota pueda comer (0 = ventana abierta) si tiene una
+// ventana sin comer abierta o que abre dentro de PREPORCION_ANTICIPO_MIN; -1 si no
+int esperaPrePorcion(const Mascota &m, uint16_t ahora) {
+  int menor = -1;
+  for (uint8_t i = 0; i < m.numVentanas; i++) {
+    const VentanaHoraria &v = m.ventanas[i];
+    if (v.yaAlimentoHoy) continue;
+    uint16_t espera = dentroDeVentana(v, ahora) ? 0 : (v.inicio + 1440 - ahora) % 1440;
+    if (espera > PREPORCION_ANTICIPO_MIN) continue;
+    if (menor < 0 || espera < menor) menor = espera;
+  }
+  return menor;
+}
+
+// La porción en la cámara sirve a esta mascota sin pasarse de su objetivo
+bool prePorcionSirveA(int idx, uint16_t ahora) {
+  if (idx < 0 || idx >= numMascotas) return false;
+  if (prePorcionKg > mascotas[idx].pesoObjetivoKg + MARGEN_CORTE_ANTICIPADO_KG) return false;
+  return esperaPrePorcion(mascotas[idx], ahora) >= 0;
+}
+
+int duenoPrePorcion() {
+  return prePorcionConDueno ? buscarMascota(prePorcionUid) : -1;
 }
 
-void imprimirUID(byte *uid) {
-  Serial.print("UID leído: ");
-  for (byte i = 0; i < UID_SIZE; i++) {
-    Serial.print("0x");
-    if (uid[i] < 0x10) Serial.print("0");
-    Serial.print(uid[i], HEX);
-    if (i < UID_SIZE - 1) Serial.print(", ");
+void asignarPrePorcion(int idx) {
+  memcpy(prePorcionUid, mascotas[idx].uid, UID_SIZE);
+  prePorcionConDueno = true;
+}
+
+// Si el dueño ya comió, se le cerró la ventana, bajó su objetivo o salió de la
+// tabla, la porción pasa a la mascota elegible más próxima que la pueda recibir
+// entera; si no hay ninguna queda sin dueño.
+void revisarPrePorcion() {
+  if (!prePorcionLista || !relojValido()) return;
+  uint16_t ahora = horaActualMin();
+  if (prePorcionSirveA(duenoPrePorcion(), ahora)) return;
+
+  int candidata = -1;
+  int menorEspera = 0;
+  for (uint8_t m = 0; m < numMascotas; m++) {
+    if (!prePorcionSirveA(m, ahora)) continue;
+    int espera = esperaPrePorcion(mascotas[m], ahora);
+    if (candidata < 0 || espera < menorEspera) { menorEspera = espera; candidata = m; }
+  }
+  if (candidata >= 0) {
+    asignarPrePorcion(candidata);
+    Serial.printf("Pre-porcion %.3f kg re-planificada para %s\n", prePorcionKg, mascotas[candidata].nombre);
+  } else if (prePorcionConDueno) {
+    prePorcionConDueno = false;
+    Serial.printf("Pre-porcion %.3f kg sin dueno\n", prePorcionKg);
   }
-  Serial.println();
 }
 
-void activarServos() {
-  servoPuerta1.attach(SERVO_PUERTA1, 500, 2400);
-  servoPuerta2.attach(SERVO_PUERTA2, 500, 2400);
-  cerrarPuerta1Lento();
-  cerrarPuerta2();
-  delay(50);
+// Planificador de pre-porciones: con la FSM ociosa y sin tarjetas en espera,
+// pesa en la cámara el objetivo de la próxima mascota sin comer cuya ventana
+// está abierta o abre dentro de PREPORCION_ANTICIPO_MIN. La porción es solo de
+// esa mascota; DOSIFICANDO completa la diferencia si su objetivo sube.
+void planificarPrePorcion() {
+  if (!PREPORCION_ACTIVA) return;
+  if (estadoActual != ESPERANDO_TARJETA || liberacionEnCurso() || !relojValido()) return;
+  if (millis() - tUltimoPlanPrePorcion < PREPORCION_PLAN_MS) return;
+  tUltimoPlanPrePorcion = millis();
+  if (prePorcionLista) {
+    revisarPrePorcion();
+    return;
+  }
+  if (pendientes.n > 0) return;   // una mascota espera: dosificar para ella y no para otra
+
+  uint16_t ahora = horaActualMin();
+  int candidata = -1;
+  int menorEspera = 0;
+  for (uint8_t m = 0; m < numMascotas; m++) {
+    if (mascotas[m].pesoObjetivoKg <= 0.0) continue;
+    int espera = esperaPrePorcion(mascotas[m], ahora);
+    if (espera < 0) continue;
+    if (candidata < 0 || espera < menorEspera) { menorEspera = espera; candidata = m; }
+  }
+  if (candidata < 0) return;
+
+  float objetivo = mascotas[candidata].pesoObjetivoKg;
+  Serial.printf("Pre-porcion: %.3f kg para %s (en %d min)\n", objetivo, mascotas[candidata].nombre, menorEspera);
+  asignarPrePorcion(candidata);
+  plazoIniciar("prePorcion", TIMEOUT_DOSIFICACION_MS + 3000);
+  activarServos();
+  balanza.power_up();
+  delay(120);
+  mfrc522.PCD_AntennaOn();
+  escanearEnDosis = true;
+  prePorcionKg = dosificar(objetivo, 0.0, mascotas[candidata].modoDosificacion);
+  escanearEnDosis = false;
+  balanza.power_down();
+  desactivarServos();
+  plazoTerminar();
+
+  prePorcionLista = true;
 }
 
-void desactivarServos() {
-  servoPuerta1.detach();
-  servoPuerta2.detach();
+// Avanza la liberación en curso; se llama en cada iteración de loop().
+// Cierra puerta 2 cuando el peso se mantiene bajo LIB_UMBRAL_VACIO_KG durante
+// LIB_VACIO_ESTABLE_MS, o al llegar al tope; si al tope queda comida se
+// reporta como atasco. Si el HX711 no dio lecturas el peso es desconocido:
+// se cierra por tiempo, sin atasco ni auto-tara. La decisión está en lib/Liberacion.
+void atenderLiberacion() {
+  switch (faseLiberacion) {
+    case LIB_ABIERTA: {
+      // sin esperar: si el HX711 no tiene muestra se mira en la próxima vuelta
+      if (liberacionMideAhora(liberacion, millis()) && balanza.is_ready()) {
+        long cuentas = (long)balanza.get_value(1);
+        traceRegistrarHx711(TRH_LIBERACION, cuentas);
+        liberacionMuestra(liberacion, kgDesdeCrudo((float)cuentas), millis(), LIB_UMBRAL_VACIO_KG);
+      }
+
+      CierreLiberacion cierre = liberacionDecidir(liberacion, millis(), TIEMPO_PUERTA2_ABIERTA_MS);
+      if (cierre == LIB_SEGUIR) break;
+
+      unsigned long abierta = millis() - tFaseLiberacion;
+      float pesoKg = liberacion.pesoKg;
+      cerrarPuerta2();
+      if (cierre == LIB_CIERRE_VACIA) {
+        Serial.printf("Camara vacia en %lu ms, cerrando puerta 2\n", abierta);
+      } else if (liberacion.numMuestras == 0) {
+        Serial.println("Liberacion: HX711 sin lecturas, cierre por tiempo");
+      } else if (liberacionAtascada(liberacion, LIB_UMBRAL_VACIO_KG)) {
+        atascosLiberacion++;
+        uint16_t gramos = (uint16_t)(pesoKg * 1000.0f + 0.5f);
+        Serial.printf("ATASCO: quedan %.3f kg en la camara tras %lu ms (atascos: %u)\n",
+                      pesoKg, abierta, (unsigned)atascosLiberacion);
+        encolarEvento(uidLiberacion, EVT_ATASCO, gramos);
+      }
+      faseLiberacion = LIB_CERRANDO;
+      tFaseLiberacion = millis();
+      break;
+    }
+    case LIB_CERRANDO:
+      if (millis() - tFaseLiberacion >= TIEMPO_CIERRE_PUERTA2_MS) {
+        // DOSIFICANDO espera a que termine la liberación, así que nadie más usa los servos
+        desactivarServos();
+        balanza.power_down();
+        faseLiberacion = LIB_INACTIVA;
+        tiemposSesion.liberaciones++;
+        tiemposSesion.sumaLiberacionMs += millis() - tInicioLiberacion;
+        // re-tarar solo si se vio la cámara vacía; con un atasco o sin lecturas el cero sería falso
+        if (liberacionVioVacia(liberacion, LIB_UMBRAL_VACIO_KG)) autoTaraPendiente = true;
+      }
+      break;
+    case LIB_INACTIVA:
+      break;
+  }
 }
 
 // Implementación de uidToString (Opción 1)
@@ -502,10 +2096,18 @@ void uidToString(const byte* uid, char* out, size_t outSize) {
   out[outSize - 1] = '\0';
 }
 
-// Obtiene timestamp ISO sin zona: "YYYY-MM-DDTHH:MM:SS"
-bool makeIsoTimestamp(char *buf, size_t len) {
+// Formatea el timestamp de un evento como ISO sin zona: "YYYY-MM-DDTHH:MM:SS"
+void eventoTimestamp(const Evento &e, char *buf, size_t len) {
+  if (e.flags & EVT_FLAG_SIN_HORA) {
+    // sin NTP: igual que antes, hora desde arranque sobre la fecha 1970-01-01
+    unsigned long s = e.epoch;
+    snprintf(buf, len, "1970-01-01T%02lu:%02lu:%02lu",
+             (s / 3600) % 24, (s / 60) % 60, s % 60);
+    return;
+  }
+  time_t t = (time_t)(e.epoch + GMT_OFFSET_S + DST_OFFSET_S);
   struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) return false;
+  gmtime_r(&t, &timeinfo);
   snprintf(buf, len, "%04d-%02d-%02dT%02d:%02d:%02d",
            timeinfo.tm_year + 1900,
            timeinfo.tm_mon + 1,
@@ -513,101 +2115,206 @@ bool makeIsoTimestamp(char *buf, size_t len) {
            timeinfo.tm_hour,
            timeinfo.tm_min,
            timeinfo.tm_sec);
-  return true;
 }
 
-// Encola evento. Devuelve true si fue encolado, false si cola llena.
-bool encolarEvento(const byte *uidBytes, EventoTipo tipo) {
+const char* nombreEvento(uint8_t tipo) {
+  switch (tipo) {
+    case EVT_DOSIFICANDO:       return "DOSIFICANDO";
+    case EVT_YA_COMIO_HOY:      return "YA_COMIO_HOY";
+    case EVT_FUERA_HORARIO:     return "FUERA_HORARIO";
+    case EVT_UID_NO_REGISTRADO: return "UID_NO_REGISTRADO";
+    case EVT_ATASCO:            return "ATASCO";
+    case EVT_CAMARA_OCUPADA:    return "CAMARA_OCUPADA";
+    default:                    return "UNKNOWN";
+  }
+}
+
+// Carga la próxima secuencia libre; las reservadas y no usadas antes del reset se saltan
+void loadSeqFromNVS() {
+  prefs.begin(PREF_NAMESPACE, true);
+  seqHead = prefs.getUInt("evseq", 0);
+  prefs.end();
+  seqReservado = seqHead;
+  Serial.printf("Secuencia de eventos inicia en %u\n", (unsigned)seqHead);
+}
+
+// Reserva un bloque de secuencias en NVS para no escribir flash por cada evento
+void reservarBloqueSeq() {
+  seqReservado += SEQ_BLOQUE;
+  prefs.begin(PREF_NAMESPACE, false);
+  prefs.putUInt("evseq", seqReservado);
+  prefs.end();
+}
+
+// Epoch para un evento; sin hora válida usa segundos desde arranque y marca el flag
+uint32_t epochEvento(uint8_t &flags) {
+  if (relojValido()) {
+    flags = 0;
+    return relojEpoch();
+  }
+  flags = EVT_FLAG_SIN_HORA;
+  return millis() / 1000;
+}
+
+// Encola evento. Devuelve el registro encolado, o nullptr si la cola está llena.
+// Solo guarda datos crudos; no consulta la hora local ni formatea strings.
+Evento* encolarEvento(const byte *uidBytes, EventoTipo tipo, uint16_t valor) {
   if (colaCount >= MAX_EVENTOS) {
     Serial.println("WARN: cola de eventos llena, evento descartado");
-    return false;
+    return nullptr;
   }
 
+  if ((int32_t)(seqHead + colaCount - seqReservado) >= 0) reservarBloqueSeq();
+
   uint16_t index = (colaHead + colaCount) % MAX_EVENTOS;
   Evento &e = colaEventos[index];
 
-  // timestamp
-  if (!makeIsoTimestamp(e.timestamp, sizeof(e.timestamp))) {
-    unsigned long ms = millis()/1000;
-    unsigned long hh = (ms / 3600) % 24;
-    unsigned long mm = (ms / 60) % 60;
-    unsigned long ss = ms % 60;
-    snprintf(e.timestamp, sizeof(e.timestamp), "1970-01-01T%02lu:%02lu:%02lu", hh, mm, ss);
-  }
-
-  // uid -> string con ":" (usa la función implementada)
-  uidToString(uidBytes, e.uid, sizeof(e.uid));
-
-  // evento string
-  switch (tipo) {
-    case EVT_DOSIFICANDO:      strncpy(e.evento, "DOSIFICANDO", sizeof(e.evento)); break;
-    case EVT_YA_COMIO_HOY:     strncpy(e.evento, "YA_COMIO_HOY", sizeof(e.evento)); break;
-    case EVT_FUERA_HORARIO:    strncpy(e.evento, "FUERA_HORARIO", sizeof(e.evento)); break;
-    case EVT_UID_NO_REGISTRADO: strncpy(e.evento, "UID_NO_REGISTRADO", sizeof(e.evento)); break;
-    default:                   strncpy(e.evento, "UNKNOWN", sizeof(e.evento));
-  }
-  e.evento[EVENT_STR_LEN-1] = '\0';
+  e.epoch = epochEvento(e.flags);
+  memcpy(e.uid, uidBytes, UID_SIZE);
+  e.tipo = (uint8_t)tipo;
+  e.valor = valor;
+  e.duracionS = 0;
 
   colaCount++;
-  return true;
+  return &e;
 }
 
-void vaciarCola() {
-  colaHead = 0;
-  colaCount = 0;
+// ---------------- Rechazos agrupados ----------------
+// El primer rechazo de un UID genera su evento y el bloqueo completo. Los
+// rechazos del mismo tipo dentro de RECHAZO_COOLDOWN_MS desde el primero solo
+// cuentan: al vencer el cooldown se emite un único evento con la cantidad y el lapso cubierto.
+
+// Emite el evento agrupado de la entrada (si hay repeticiones pendientes)
+void encolarRechazosAgrupados(UIDVisto &c) {
+  if (c.repeticiones == 0 || c.rechazo == RECHAZO_NINGUNO) return;
+  Evento* e = encolarEvento(c.uid, (EventoTipo)c.rechazo, c.repeticiones);
+  if (e) {
+    e->epoch = c.epochPrimero;
+    e->flags = c.flagsEpoch;
+    uint32_t lapso = c.epochUltimo - c.epochPrimero;
+    e->duracionS = (lapso > 0xFFFF) ? 0xFFFF : (uint16_t)lapso;
+  }
+  c.repeticiones = 0;
 }
 
-String colaToJsonBatch(const char *deviceId) {
-  if (colaCount == 0) return String();
-
-  String s;
-  s.reserve(colaCount * 120);
-  s += "{\"device\":\""; s += deviceId; s += "\",\"eventos\":[";
+// Registra un rechazo y fija cuánto dura el BLOQUEADO que sigue
+void registrarRechazo(const byte* uid, EventoTipo tipo) {
+  UIDVisto &c = obtenerVisto(uid);
+  bool repetido = (c.rechazo == tipo && millis() - c.tPrimerRechazo < RECHAZO_COOLDOWN_MS);
+
+  if (repetido) {
+    uint8_t flags;
+    uint32_t ahora = epochEvento(flags);
+    if (c.repeticiones == 0) {
+      c.epochPrimero = ahora;
+      c.flagsEpoch = flags;
+    }
+    c.epochUltimo = ahora;
+    c.repeticiones++;
+    duracionBloqueo = RECHAZO_REPETIDO_LED_MS;
+  } else {
+    encolarRechazosAgrupados(c);
+    encolarEvento(uid, tipo, 1);
+    c.rechazo = tipo;
+    c.tPrimerRechazo = millis();
+    duracionBloqueo = LED_ROJO_NO_AUT_MS;
+  }
+  uint32_t ahoraMin = relojValido() ? relojEpochLocal() / 60 : 0;
+  c.cfgRechazo = configVersion;
+  c.diaRechazo = ultimoDia;
+  c.venceMinRechazo = ahoraMin + minutosHastaBorde(horaActualMin());
+}
 
-  for (uint16_t i = 0; i < colaCount; i++) {
-    uint16_t idx = (colaHead + i) % MAX_EVENTOS;
-    Evento &e = colaEventos[idx];
+// Rechazo todavía vigente para este UID sin necesidad de revalidar.
+// FUERA_HORARIO no se reutiliza porque la ventana puede abrir en cualquier minuto,
+// ni CAMARA_OCUPADA porque la pre-porción puede re-planificarse en cualquier momento;
+// los demás cambian con una nueva configuración, un nuevo día o al cruzar el
+// borde de cualquier ventana (las de una mascota pueden solaparse).
+bool rechazoVigente(const byte* uid, EventoTipo &tipo) {
+  UIDVisto* c = buscarVisto(uid);
+  if (!c || c->rechazo == RECHAZO_NINGUNO || c->rechazo == EVT_FUERA_HORARIO) return false;
+  if (c->rechazo == EVT_CAMARA_OCUPADA) return false;   // se libera con la próxima sesión
+  if (millis() - c->tPrimerRechazo >= RECHAZO_COOLDOWN_MS) return false;
+  if (c->cfgRechazo != configVersion || c->diaRechazo != ultimoDia) return false;
+  uint32_t ahoraMin = relojValido() ? relojEpochLocal() / 60 : 0;
+  if ((int32_t)(ahoraMin - c->venceMinRechazo) >= 0) return false;
+  tipo = (EventoTipo)c->rechazo;
+  return true;
+}
 
-    const char* nombreMascota = nombrePorUID(e.uid);
+// Cierra los grupos cuyo cooldown venció; se llama desde loop()
+void atenderRechazos() {
+  for (uint8_t i = 0; i < RFID_CACHE_VISTOS; i++) {
+    UIDVisto &c = uidsVistos[i];
+    if (!c.usado || c.rechazo == RECHAZO_NINGUNO) continue;
+    if (millis() - c.tPrimerRechazo < RECHAZO_COOLDOWN_MS) continue;
+    encolarRechazosAgrupados(c);
+    c.rechazo = RECHAZO_NINGUNO;
+  }
+}
 
-    s += "{\"fecha\":\""; s += String(e.timestamp).substring(0,10); s += "\"";
-    s += ",\"hora\":\""; s += String(e.timestamp).substring(11,19); s += "\"";
-    s += ",\"mascota\":\""; s += nombreMascota; s += "\"";
-    s += ",\"evento\":\""; s += e.evento; s += "\"}";
+// Una validación exitosa cierra cualquier grupo de rechazos abierto del UID
+void limpiarRechazo(const byte* uid) {
+  UIDVisto* c = buscarVisto(uid);
+  if (!c) return;
+  encolarRechazosAgrupados(*c);
+  c->rechazo = RECHAZO_NINGUNO;
+}
 
-    if (i < colaCount - 1) s += ",";
+// Retira de la cola todos los eventos con seq <= ack (ACK acumulativo)
+void procesarAckEventos(uint32_t ack) {
+  int32_t n = (int32_t)(ack - seqHead) + 1;
+  if (n <= 0) return;                 // ACK viejo o duplicado
+  if (n > colaEnviados) {             // no se puede confirmar lo que no se envió
+    Serial.printf("ACK de eventos %u fuera de la ventana, se limita a lo enviado\n", (unsigned)ack);
+    n = colaEnviados;
+    if (n == 0) return;
   }
 
-  s += "]}";
-  return s;
+  colaHead = (colaHead + n) % MAX_EVENTOS;
+  colaCount -= n;
+  seqHead += n;
+  colaEnviados -= n;
+  tUltimoAck = millis();
+  Serial.printf("ACK eventos hasta seq %u, pendientes=%u\n", (unsigned)ack, (unsigned)colaCount);
+  // la ventana tiene lugar: seguir con los que esperan sin aguardar al próximo intervalo
+  if (colaCount > colaEnviados) solicitarEventos();
 }
 
 // ---------------- MQTT: envío individual ----------------
-bool publishEventoIndividual(const Evento &e) {
+size_t publishEventoIndividual(const Evento &e, uint32_t seq) {
   char payload[256];
+  char ts[TS_STR_LEN];
+  eventoTimestamp(e, ts, sizeof(ts));
   const char *masc = nombrePorUID(e.uid);
+  char extra[48];
+  if (e.tipo == EVT_DOSIFICANDO) {
+    snprintf(extra, sizeof(extra), "\"gramos\":%u", (unsigned)e.valor);
+  } else if (e.tipo == EVT_ATASCO) {
+    snprintf(extra, sizeof(extra), "\"gramos_restantes\":%u", (unsigned)e.valor);
+  } else {
+    snprintf(extra, sizeof(extra), "\"repeticiones\":%u,\"duracion_s\":%u",
+             (unsigned)e.valor, (unsigned)e.duracionS);
+  }
   int n = snprintf(payload, sizeof(payload),
-                   "{\"fecha\":\"%.10s\",\"hora\":\"%s\",\"mascota\":\"%s\",\"evento\":\"%s\"}",
-                   e.timestamp,
-                   &e.timestamp[11],
+                   "{\"seq\":%u,\"fecha\":\"%.10s\",\"hora\":\"%s\",\"mascota\":\"%s\",\"evento\":\"%s\",%s}",
+                   (unsigned)seq,
+                   ts,
+                   &ts[11],
                    masc,
-                   e.evento);
+                   nombreEvento(e.tipo),
+                   extra);
   if (n < 0 || n >= (int)sizeof(payload)) {
     Serial.println("Payload demasiado largo para evento individual");
-    return false;
+    return 0;
   }
 
+  // sin reconectar acá: conectarMQTT() reinicia la ventana que está recorriendo el llamador
   if (!mqtt.connected()) {
-    Serial.println("MQTT desconectado al intentar publicar evento individual, intentando reconectar...");
-    conectarMQTT();
-    if (!mqtt.connected()) {
-      Serial.println("No se pudo reconectar MQTT");
-      return false;
-    }
+    Serial.println("MQTT desconectado al publicar evento individual");
+    return 0;
   }
 
-  mqtt.loop(); // procesar pings/etc
-
   bool ok = mqtt.publish(TOPIC_EVENTOS, payload, false);
   if (!ok) {
     Serial.print("Publish evento individual falló, mqtt.state()=");
@@ -615,22 +2322,226 @@ bool publishEventoIndividual(const Evento &e) {
     Serial.print("FreeHeap: "); Serial.println(ESP.getFreeHeap());
     Serial.print("Payload len: "); Serial.println(strlen(payload));
   }
-  return ok;
+  return ok ? n : 0;
+}
+
+// Carril de eventos: tras solicitarEventos() publica hasta llenar la ventana.
+// Los eventos quedan en la cola hasta recibir su ACK; si el ACK no llega a
+// tiempo se reenvía desde colaHead.
+bool eventosPorEnviar() {
+  if (!eventosSolicitados) return false;
+  if (colaEnviados > 0 && millis() - tUltimoAck > ACK_TIMEOUT_MS) {
+    Serial.printf("Sin ACK de eventos, reenviando desde seq %u\n", (unsigned)seqHead);
+    colaEnviados = 0;
+  }
+  if (colaEnviados >= colaCount || colaEnviados >= VENTANA_ENVIO) {
+    eventosSolicitados = false;
+    return false;
+  }
+  return true;
+}
+
+size_t publicarSiguienteEvento() {
+  mqtt.loop(); // puede procesar ACKs y mover colaHead
+  if (!mqtt.connected()) {
+    // se cortó: la ventana se retoma desde colaHead tras reconectar
+    eventosSolicitados = false;
+    return 0;
+  }
+  if (colaEnviados >= colaCount) return 0;
+  uint16_t idx = (colaHead + colaEnviados) % MAX_EVENTOS;
+
+  size_t n = publishEventoIndividual(colaEventos[idx], seqHead + colaEnviados);
+  if (n == 0) {
+    Serial.println("Fallo al publicar evento, preservando cola");
+    return 0;
+  }
+  if (colaEnviados == 0) tUltimoAck = millis(); // arranca el timeout de la ventana
+  colaEnviados++;
+  return n;
+}
+
+// ---------------- MQTT: planificador de salida ----------------
+static unsigned long tTickSalida = 0;
+static long bytesDisponibles = 0;   // puede quedar negativo: deuda para el próximo tick
+static unsigned long msgsDisponibles = 0;
+static bool tickSaturado = false;
+static uint8_t turnoCarril = CARRIL_ESTADO;
+static uint8_t carrilesFallidos = 0;   // bit por carril que falló en este tick
+static uint8_t reintentosControl = 0;
+
+size_t publishSalida() {
+  StaticJsonDocument<768> doc;
+  doc["bytes_tick"] = SALIDA_BYTES_TICK;
+  doc["msgs_tick"] = SALIDA_MSGS_TICK;
+  doc["ticks_saturados"] = ticksSaturados;
+  doc["control_descartados"] = controlDescartados;
+  JsonObject carriles = doc.createNestedObject("carriles");
+  for (uint8_t c = 0; c < NUM_CARRILES; c++) {
+    const MetricaCarril &m = metricasCarril[c];
+    JsonObject o = carriles.createNestedObject(NOMBRE_CARRIL[c]);
+    o["enviados"] = m.enviados;
+    o["bytes"] = m.bytes;
+    o["espera_prom_ms"] = m.enviados ? m.esperaSumaMs / m.enviados : 0;
+    o["espera_max_ms"] = m.esperaMaxMs;
+    o["fallos"] = m.fallos;
+    o["descartados"] = m.descartados;
+  }
+
+  char buffer[768];
+  size_t n = serializeJson(doc, buffer, sizeof(buffer));
+  if (!mqtt.publish(TOPIC_SALIDA, (const uint8_t*)buffer, n, false)) return 0;
+  Serial.println("Metricas de salida publicadas");
+  return n;
+}
+
+bool carrilPendiente(uint8_t carril) {
+  if (carril == CARRIL_CONTROL) return controlCount > 0;
+  if (carril == CARRIL_EVENTOS) return eventosPorEnviar();
+  for (uint8_t i = 0; i < NUM_SALIDA_ITEMS; i++) {
+    if ((salidaPendiente & (1 << i)) && CARRIL_DE_ITEM[i] == carril) return true;
+  }
+  return false;
+}
+
+// Control tiene prioridad estricta; el resto se turna de a un mensaje
+uint8_t siguienteCarril() {
+  if (controlCount > 0 && !(carrilesFallidos & (1 << CARRIL_CONTROL))) return CARRIL_CONTROL;
+  for (uint8_t k = 0; k < NUM_CARRILES - 1; k++) {
+    uint8_t c = turnoCarril;
+    turnoCarril = (turnoCarril == NUM_CARRILES - 1) ? CARRIL_ESTADO : turnoCarril + 1;
+    if (!(carrilesFallidos & (1 << c)) && carrilPendiente(c)) return c;
+  }
+  return NUM_CARRILES;
+}
+
+void registrarEnvio(uint8_t carril, size_t bytes, unsigned long tSolicitud) {
+  MetricaCarril &m = metricasCarril[carril];
+  uint32_t espera = millis() - tSolicitud;
+  m.enviados++;
+  m.bytes += bytes;
+  m.esperaSumaMs += espera;
+  if (espera > m.esperaMaxMs) m.esperaMaxMs = espera;
+  bytesDisponibles -= (long)bytes;
+  if (msgsDisponibles > 0) msgsDisponibles--;
+}
+
+// Un fallo ocupa un mensaje del tick; atenderSalida() deja al carril fuera
+// hasta el próximo, así un item que no sale (p. ej. más grande que el buffer
+// de MQTT) no frena a los demás carriles
+void registrarFallo(uint8_t carril) {
+  metricasCarril[carril].fallos++;
+  if (msgsDisponibles > 0) msgsDisponibles--;
 }
 
-void enviarColaPorEventos() {
-  while (colaCount > 0) {
-    uint16_t idx = colaHead % MAX_EVENTOS;
-    Evento &e = colaEventos[idx];
+// true si ya falló SALIDA_MAX_REINTENTOS veces seguidas: hay que descartarlo
+bool agotoReintentos(uint8_t carril, uint8_t &reintentos) {
+  if (++reintentos < SALIDA_MAX_REINTENTOS) return false;
+  reintentos = 0;
+  metricasCarril[carril].descartados++;
+  return true;
+}
 
-    mqtt.loop();
-    if (publishEventoIndividual(e)) {
-      colaHead = (colaHead + 1) % MAX_EVENTOS;
-      colaCount--;
+// Publica un mensaje del carril; false si falló. Los ACKs e items se descartan
+// tras SALIDA_MAX_REINTENTOS fallos; los eventos nunca (los retiene la cola
+// hasta el ACK del backend).
+bool enviarDeCarril(uint8_t carril) {
+  if (carril == CARRIL_CONTROL) {
+    MensajeControl &m = colaControl[controlHead];
+    bool ok = mqtt.publish(TOPIC_CONFIG_ACK, m.payload, false);
+    if (ok) {
+      reintentosControl = 0;
+      Serial.print("ACK enviado: ");
+      Serial.println(m.payload);
+      registrarEnvio(carril, strlen(m.payload), m.tEncolado);
     } else {
-      Serial.println("Fallo al publicar evento, preservando cola");
+      registrarFallo(carril);
+      if (!agotoReintentos(carril, reintentosControl)) return false;
+      Serial.print("ACK descartado: ");
+      Serial.println(m.payload);
+    }
+    controlHead = (controlHead + 1) % CONTROL_SLOTS;
+    controlCount--;
+    return ok;
+  }
+
+  if (carril == CARRIL_EVENTOS) {
+    size_t n = publicarSiguienteEvento();
+    if (n == 0) {
+      registrarFallo(carril);
+      return false;
+    }
+    registrarEnvio(carril, n, tSolicitudEventos);
+    return true;
+  }
+
+  uint8_t item = 0;
+  while (item < NUM_SALIDA_ITEMS && !((salidaPendiente & (1 << item)) && CARRIL_DE_ITEM[item] == carril)) item++;
+  if (item == NUM_SALIDA_ITEMS) return false;
+
+  bool terminado = true;
+  size_t n = 0;
+  switch (item) {
+    case SAL_CONFIG_STATUS: n = publishConfigStatus(); break;
+    case SAL_PARAMS:        n = publishParametros(terminado); break;
+    case SAL_BALANZA:       n = publishBalanza(); break;
+    case SAL_OVERRUNS:      n = publishOverruns(terminado); break;
+    case SAL_METRICAS:      n = publishSalida(); break;
+    case SAL_SESIONES:      n = publishSesiones(); break;
+    case SAL_MASCOTAS:      n = publishMascotas(); break;
+    case SAL_TRACE:         n = publishTraceBloque(terminado); break;
+  }
+  if (n == 0) {
+    registrarFallo(carril);
+    if (agotoReintentos(carril, reintentosItem[item])) {
+      salidaPendiente &= ~(1 << item);
+      Serial.printf("Salida: item %u descartado tras %u fallos\n", (unsigned)item, (unsigned)SALIDA_MAX_REINTENTOS);
+    }
+    return false;
+  }
+  reintentosItem[item] = 0;
+  registrarEnvio(carril, n, tSolicitudItem[item]);
+  if (terminado) salidaPendiente &= ~(1 << item);
+  return true;
+}
+
+// Llamar en cada loop: renueva el presupuesto por tick y publica lo que entre
+void atenderSalida() {
+  if (millis() - tTickSalida >= SALIDA_TICK_MS) {
+    tTickSalida = millis();
+    if (tickSaturado) ticksSaturados++;
+    tickSaturado = false;
+    // un mensaje más grande que el saldo se descuenta del tick siguiente
+    bytesDisponibles = (bytesDisponibles < 0 ? bytesDisponibles : 0) + (long)SALIDA_BYTES_TICK;
+    msgsDisponibles = SALIDA_MSGS_TICK;
+    carrilesFallidos = 0;
+  }
+  if (!mqtt.connected()) return;
+
+  plazoIniciar("salida", 2000);
+  while (true) {
+    uint8_t carril = siguienteCarril();
+    if (carril == NUM_CARRILES) break;
+    if (msgsDisponibles == 0 || bytesDisponibles <= 0) {
+      tickSaturado = true;
       break;
     }
+    if (!enviarDeCarril(carril)) {
+      if (!mqtt.connected()) break;
+      carrilesFallidos |= (1 << carril); // se reintenta en el próximo tick; los demás siguen
+      continue;
+    }
+    alimentarWatchdog();
+  }
+  plazoTerminar();
+}
+
+// Solo el carril de control, para los lazos que bloquean loop() y bombean
+// mqtt.loop(): un pedido de config recibido ahí tiene su ACK sin esperar a que
+// termine la dosis. Lo enviado se descuenta del presupuesto del tick.
+void atenderControl() {
+  while (controlCount > 0 && mqtt.connected()) {
+    if (!enviarDeCarril(CARRIL_CONTROL)) break;   // se reintenta en atenderSalida()
   }
 }
 
@@ -645,6 +2556,15 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
     return;
   }
 
+  if (strcmp(topic, TOPIC_EVENTOS_ACK) == 0) {
+    if (!doc.containsKey("ack")) {
+      Serial.println("ACK de eventos sin campo 'ack'");
+      return;
+    }
+    procesarAckEventos(doc["ack"].as<uint32_t>());
+    return;
+  }
+
   const char* action = doc["action"];
   if (!action) {
     Serial.println("Config JSON sin campo 'action'");
@@ -652,11 +2572,120 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
     return;
   }
 
+  {
+    TraceAccion ta = TRA_DESCONOCIDA;
+    if (strcmp(action, "get_mascotas") == 0)    ta = TRA_GET_MASCOTAS;
+    else if (strcmp(action, "delete") == 0)     ta = TRA_DELETE;
+    else if (strcmp(action, "upsert") == 0)     ta = TRA_UPSERT;
+    else if (strcmp(action, "get_param") == 0)  ta = TRA_GET_PARAM;
+    else if (strcmp(action, "set_param") == 0)  ta = TRA_SET_PARAM;
+    else if (strcmp(action, "dump_trace") == 0) ta = TRA_DUMP_TRACE;
+    else if (strcmp(action, "get_overruns") == 0) ta = TRA_GET_OVERRUNS;
+    else if (strcmp(action, "get_salida") == 0) ta = TRA_GET_SALIDA;
+    else if (strcmp(action, "get_sesiones") == 0) ta = TRA_GET_SESIONES;
+    else if (strncmp(action, "calib", 5) == 0 || strcmp(action, "get_balanza") == 0 ||
+             strcmp(action, "tarar") == 0) ta = TRA_BALANZA;
+    const char* uidTr = (ta == TRA_UPSERT) ? (const char*)doc["mascota"]["uid"] : (const char*)doc["uid"];
+    byte uidTrBytes[UID_SIZE];
+    uint32_t valor = (uidTr && uidStringToBytes(uidTr, uidTrBytes)) ? empaquetarUID(uidTrBytes) : 0;
+    traceRegistrar(TR_CONFIG, ta, valor);
+  }
+
+  if (strcmp(action, "get_overruns") == 0) {
+    solicitarOverruns();
+    return;
+  }
+
+  if (strcmp(action, "get_salida") == 0) {
+    solicitarSalida(SAL_METRICAS);
+    return;
+  }
+
+  if (strcmp(action, "get_sesiones") == 0) {
+    solicitarSalida(SAL_SESIONES);
+    return;
+  }
+
+  // -------------------- BALANZA --------------------
+  if (strcmp(action, "get_balanza") == 0) {
+    solicitarSalida(SAL_BALANZA);
+    return;
+  }
+
+  // tara y calibración se difieren a loop(): aquí la cámara puede tener comida
+  if (strcmp(action, "tarar") == 0) {
+    taraPedida = true;
+    return;
+  }
+
+  if (strcmp(action, "calib_punto") == 0) {
+    if (!doc.containsKey("kg")) {
+      sendConfigAck("calib_punto", "", "ERROR: kg_missing");
+      return;
+    }
+    calibPedidaKg = doc["kg"].as<float>();
+    calibPedida = true;
+    return;
+  }
+
+  if (strcmp(action, "calib_reset") == 0) {
+    calibResetPedido = true;
+    return;
+  }
+
+  // -------------------- TRAZAS --------------------
+  if (strcmp(action, "dump_trace") == 0) {
+    uint32_t desde = doc["desde"] | traceSeqMasVieja();
+    uint16_t max = doc["max"] | 256;
+    if (max > 1024) max = 1024;
+    solicitarTrace(desde, max);
+    return;
+  }
+
   if (strcmp(action, "get_mascotas") == 0) {
-  publishMascotas();
+  solicitarSalida(SAL_MASCOTAS);
   return;
   }
 
+  // -------------------- PARAMETROS --------------------
+  if (strcmp(action, "get_param") == 0) {
+    const char* nombre = doc["name"];
+    int idx = nombre ? buscarParametro(nombre) : -1;
+    if (nombre && idx < 0) {
+      sendConfigAck("get_param", "", "ERROR: unknown_param");
+      return;
+    }
+    solicitarParametros(idx); // sin "name" -> todos
+    return;
+  }
+
+  if (strcmp(action, "set_param") == 0) {
+    const char* nombre = doc["name"];
+    if (!nombre) {
+      sendConfigAck("set_param", "", "ERROR: name_missing");
+      return;
+    }
+    int idx = buscarParametro(nombre);
+    if (idx < 0) {
+      sendConfigAck("set_param", "", "ERROR: unknown_param");
+      return;
+    }
+    if (!doc.containsKey("value")) {
+      sendConfigAck("set_param", "", "ERROR: value_missing");
+      return;
+    }
+    if (!escribirParametro(parametros[idx], doc["value"].as<float>())) {
+      sendConfigAck("set_param", "", "ERROR: out_of_range");
+      return;
+    }
+
+    paramsPendientes = true; // NVS fuera del callback: puede correr en plena dosificación
+    Serial.printf("Parametro %s actualizado\n", parametros[idx].nombre);
+    sendConfigAck("set_param", "", "OK");
+    solicitarParametros(idx);
+    return;
+  }
+
 
   // -------------------- DELETE --------------------
   if (strcmp(action, "delete") == 0) {
@@ -667,23 +2696,28 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       return;
     }
 
-    int idx = buscarMascotaPorUIDStr(uidStr);
+    // buscar en la versión más nueva (la pendiente si existe) sin iniciar una
+    byte uidBytes[UID_SIZE];
+    const Mascota* ultima = configPendiente ? tablasMascotas[tablaActiva ^ 1] : mascotas;
+    uint8_t nUltima = configPendiente ? numMascotasSiguiente : numMascotas;
+    int idx = uidStringToBytes(uidStr, uidBytes) ? buscarEnTabla(ultima, nUltima, uidBytes) : -1;
     if (idx < 0) {
       sendConfigAck("delete", uidStr, "ERROR: not_found");
       return;
     }
+    Mascota* sig = tablaSiguiente();
 
-    // Compactar array (eliminar elemento)
-    for (int i = idx; i < (int)numMascotas - 1; i++) {
-      mascotas[i] = mascotas[i + 1];
+    // Compactar la tabla siguiente; la activa no se toca hasta publicarla
+    for (int i = idx; i < (int)numMascotasSiguiente - 1; i++) {
+      sig[i] = sig[i + 1];
     }
-    if (numMascotas > 0) numMascotas--;
+    if (numMascotasSiguiente > 0) numMascotasSiguiente--;
 
-    // Persistir y confirmar
-    bumpConfigVersionAndSave();                // incrementa configVersion y guarda en NVS
+    // Confirmar; la publicación y el guardado en NVS ocurren fuera de la sesión
+    configVersionSiguiente++;
     sendConfigAck("delete", uidStr, "OK");    // enviar ACK de éxito
 
-    Serial.printf("Mascota %s eliminada. numMascotas=%u\n", uidStr, (unsigned)numMascotas);
+    Serial.printf("Mascota %s eliminada. numMascotas=%u\n", uidStr, (unsigned)numMascotasSiguiente);
     return;
   }
 
@@ -709,20 +2743,36 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       return;
     }
 
-    // buscar si existe
-    int idx = buscarMascota(uidBytes);
+    // peso objetivo (opcional) - se valida antes de tocar la tabla
+    bool hayPeso = mv.containsKey("pesoObjetivoKg");
+    float peso = hayPeso ? mv["pesoObjetivoKg"].as<float>() : 0.0f;
+    // opcional: validar rango sensato del peso
+    if (hayPeso && !(peso >= 0.0f && peso < 10.0f)) { // ejemplo: <10kg razonable
+      // si el peso es inválido, rechazamos con ACK y no aplicamos cambios
+      sendConfigAck("upsert", uidStr, "ERROR: peso_invalid");
+      return;
+    }
+
+    // buscar si existe en la versión más nueva; el límite se revisa antes de
+    // iniciar una, así un rechazo no deja una configuración pendiente
+    const Mascota* ultima = configPendiente ? tablasMascotas[tablaActiva ^ 1] : mascotas;
+    uint8_t nUltima = configPendiente ? numMascotasSiguiente : numMascotas;
+    int idx = buscarEnTabla(ultima, nUltima, uidBytes);
+    if (idx < 0 && nUltima >= MAX_MASCOTAS) {
+      sendConfigAck("upsert", uidStr, "ERROR: max_mascotas");
+      return;
+    }
+
+    Mascota* sig = tablaSiguiente();
     bool nueva = false;
     if (idx < 0) {
-      if (numMascotas >= MAX_MASCOTAS) {
-        sendConfigAck("upsert", uidStr, "ERROR: max_mascotas");
-        return;
-      }
-      idx = numMascotas++;
+      idx = numMascotasSiguiente++;
+      memset(&sig[idx], 0, sizeof(Mascota));
       nueva = true;
     }
 
-    // Referencia a la mascota en RAM
-    Mascota &mascota = mascotas[idx];
+    // Referencia a la mascota en la tabla siguiente
+    Mascota &mascota = sig[idx];
     memcpy(mascota.uid, uidBytes, UID_SIZE);
 
     // nombre (opcional)
@@ -734,19 +2784,14 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       }
     }
 
-    // peso objetivo (opcional)
-    if (mv.containsKey("pesoObjetivoKg")) {
-      float p = mv["pesoObjetivoKg"].as<float>();
-      // opcional: validar rango sensato del peso
-      if (p >= 0.0f && p < 10.0f) { // ejemplo: <10kg razonable
-        mascota.pesoObjetivoKg = p;
-      } else {
-        // si el peso es inválido, rechazamos con ACK y no aplicamos cambios
-        sendConfigAck("upsert", uidStr, "ERROR: peso_invalid");
-        // si creamos la entrada y no queremos dejarla vacía, decrementamos numMascotas
-        if (nueva && numMascotas > 0) numMascotas--;
-        return;
-      }
+    if (hayPeso) mascota.pesoObjetivoKg = peso;
+
+    // modo de dosificación (opcional): "pulsos", "continuo" o "tolva"
+    if (mv.containsKey("dosificacion")) {
+      const char* modo = (const char*)mv["dosificacion"];
+      if (modo && strcmp(modo, "pulsos") == 0) mascota.modoDosificacion = DOSIF_PULSOS;
+      else if (modo && strcmp(modo, "continuo") == 0) mascota.modoDosificacion = DOSIF_CONTINUO;
+      else mascota.modoDosificacion = DOSIF_TOLVA;
     }
 
     // ventanas (opcional) - validamos 0..1439
@@ -771,11 +2816,11 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       mascota.numVentanas = count;
     }
 
-    // persistir y confirmar
-    bumpConfigVersionAndSave();
+    // confirmar; la publicación y el guardado en NVS ocurren fuera de la sesión
+    configVersionSiguiente++;
     sendConfigAck("upsert", uidStr, "OK");
 
-    Serial.printf("%s mascota %s (idx=%d). numMascotas=%u\n", (nueva ? "Agregada":"Actualizada"), uidStr, idx, (unsigned)numMascotas);
+    Serial.printf("%s mascota %s (idx=%d). numMascotas=%u\n", (nueva ? "Agregada":"Actualizada"), uidStr, idx, (unsigned)numMascotasSiguiente);
     return;
   }
 
@@ -787,9 +2832,39 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
 }
 
 
+// Callback de cambio de día del reloj: reset diario de ventanas
+void resetVentanasDiarias(int32_t dia) {
+  for (uint8_t m = 0; m < numMascotas; m++) {
+    for (uint8_t v = 0; v < mascotas[m].numVentanas; v++) {
+      mascotas[m].ventanas[v].yaAlimentoHoy = false;
+    }
+    gramosHoy[m] = 0;
+  }
+  generacionRespuestas++;
+  Serial.printf("Nuevo dia detectado (%ld) -> ventanas reseteadas\n", (long)dia);
+}
+
 // ================ SETUP ===================
 void setup() {
   Serial.begin(115200);
+  bool recuperandoCuelgue = iniciarMonitorPlazos();
+  relojAlCambiarDia = resetVentanasDiarias;
+
+  // Reservar timers para servos y fijar periodo (50 Hz).
+  ESP32PWM::allocateTimer(0);
+  ESP32PWM::allocateTimer(1);
+  ESP32PWM::allocateTimer(2);
+  ESP32PWM::allocateTimer(3);
+  servoPuerta1.setPeriodHertz(50);
+  servoPuerta2.setPeriodHertz(50);
+
+  if (recuperandoCuelgue) {
+    // el cuelgue pudo dejar una puerta abierta: cerrarla antes de esperar a WiFi y NTP
+    activarServos();
+    delay(TIEMPO_CIERRE_PUERTA2_MS); // dejar que puerta 2 llegue antes de soltar los servos
+    desactivarServos();
+    Serial.println("Puertas cerradas tras reinicio por watchdog");
+  }
 
   conectarWiFi();
   configurarHora();
@@ -804,22 +2879,20 @@ void setup() {
   mfrc522.PCD_Init();
   mfrc522.PCD_AntennaOff();
 
-  // Reservar timers para servos y fijar periodo (50 Hz).
-  ESP32PWM::allocateTimer(0);
-  ESP32PWM::allocateTimer(1);
-  ESP32PWM::allocateTimer(2);
-  ESP32PWM::allocateTimer(3);
-  servoPuerta1.setPeriodHertz(50);
-  servoPuerta2.setPeriodHertz(50);
+  traceIniciar();
 
   // HX711: inicializar, calibrar y apagar (power_down real)
   balanza.begin(HX711_DT, HX711_SCK);
+  loadParamsFromNVS(); // aplica CALIBRATION_FACTOR guardado
+  loadCalibracionFromNVS();
   balanza.set_scale(CALIBRATION_FACTOR);
   balanza.tare();
+  traceRegistrarHx711(TRH_TARA, balanza.get_offset());
+  registrarTara(balanza.get_offset());
   balanza.power_down();
 
   // Ejemplo en RAM
-  Mascota m1;
+  Mascota m1 = {};   // modoDosificacion = DOSIF_TOLVA
   m1.uid[0]=0x15; m1.uid[1]=0x57; m1.uid[2]=0xA9; m1.uid[3]=0xB1;
   strncpy(m1.nombre, "Firulais", sizeof(m1.nombre));
   m1.pesoObjetivoKg = 0.020;
@@ -829,7 +2902,7 @@ void setup() {
   m1.numVentanas = 3;
   mascotas[numMascotas++] = m1;
 
-  Mascota m2;
+  Mascota m2 = {};   // modoDosificacion = DOSIF_TOLVA
   m2.uid[0]=0x1C; m2.uid[1]=0xE4; m2.uid[2]=0x00; m2.uid[3]=0x39;
   strncpy(m2.nombre, "Pelusa", sizeof(m2.nombre));
   m2.pesoObjetivoKg = 0.020;
@@ -844,41 +2917,77 @@ void setup() {
   // registrar callback antes de conectar para que onConnect lo mantenga si reconectamos
   mqtt.setCallback(mqttCallback);
   mqtt.setKeepAlive(120);   // 120 segundos
+  // PubSubClient 2.8 se compila aparte con su buffer de 256 bytes: el #define no le llega
+  if (!mqtt.setBufferSize(MQTT_MAX_PACKET_SIZE)) {
+    Serial.printf("ERROR: sin memoria para el buffer MQTT de %u bytes\n", (unsigned)MQTT_MAX_PACKET_SIZE);
+  }
   // cargar configuración guardada (si existe)
   loadConfigFromNVS();
+  loadSeqFromNVS();
+  iniciarPersistencia();
+  traceRegistrar(TR_ARRANQUE, 0, configVersion);
   conectarMQTT();
 }
 
 // ================ LOOP ====================
-void loop() {
-  // Detectar nuevo día para reset diario
-  struct tm timeinfo_now;
-  if (getLocalTime(&timeinfo_now)) {
-    if (timeinfo_now.tm_yday != ultimoDia) {
-      ultimoDia = timeinfo_now.tm_yday;
-      for (uint8_t m = 0; m < numMascotas; m++) {
-        for (uint8_t v = 0; v < mascotas[m].numVentanas; v++) {
-          mascotas[m].ventanas[v].yaAlimentoHoy = false;
-        }
-      }
-      Serial.println("Nuevo dia detectado -> ventanas reseteadas");
-    }
+// Presupuesto de tiempo de una pasada del loop en cada estado
+uint32_t presupuestoEstado(EstadoSistema e) {
+  switch (e) {
+    case DOSIFICANDO: return TIMEOUT_DOSIFICACION_MS + 3000; // incluye lecturas y servos
+    case ESPERANDO_TARJETA: return 300;
+    default: return 200;
+  }
+}
+
+const char* nombreEstado(EstadoSistema e) {
+  switch (e) {
+    case ESPERANDO_TARJETA: return "ESPERANDO";
+    case VALIDANDO:         return "VALIDANDO";
+    case DOSIFICANDO:       return "DOSIFICANDO";
+    case LIBERANDO:         return "LIBERANDO";
+    case BLOQUEADO:         return "BLOQUEADO";
+    default:                return "?";
   }
+}
 
+void loop() {
+  alimentarWatchdog();
+  publicarConfigPendiente(); // solo entre sesiones
+  guardarParamsPendientes();
+  traceVolcar();
+  atenderLiberacion();
+  relojActualizar(); // dispara resetVentanasDiarias() al cambiar de día
+  atenderBalanzaPedida();
+  atenderAutoTara(); // antes de pre-porcionar: la cámara todavía está vacía
+  planificarPrePorcion();
+  atenderRechazos();
+
+  EstadoSistema estadoPrevio = estadoActual;
+
+  plazoIniciar(nombreEstado(estadoActual), presupuestoEstado(estadoActual));
   switch (estadoActual) {
     case ESPERANDO_TARJETA: {
       mfrc522.PCD_AntennaOn();
-      if (!mfrc522.PICC_IsNewCardPresent()) break;
-      if (!mfrc522.PICC_ReadCardSerial()) break;
+      escanearTarjetas();
+      if (!tomarPendiente(uidLeido)) break;
 
-      for (byte i = 0; i < UID_SIZE; i++) uidLeido[i] = mfrc522.uid.uidByte[i];
       hayUIDLeido = true;
-      mfrc522.PICC_HaltA();
-      mfrc522.PCD_StopCrypto1();
       mfrc522.PCD_AntennaOff();
 
       indiceMascotaActual = buscarMascota(uidLeido);
       matchedWindowIndex = -1;
+
+      // UID recién rechazado: no revalidar, solo contar y bloqueo corto
+      EventoTipo rechazoPrevio;
+      if (rechazoVigente(uidLeido, rechazoPrevio)) {
+        registrarRechazo(uidLeido, rechazoPrevio);
+        hayUIDLeido = false;
+        estadoActual = BLOQUEADO;
+        break;
+      }
+
+      tInicioSesion = millis();
+      tEsperaPuerta2 = 0;
       estadoActual = VALIDANDO;
       break;
     }
@@ -893,7 +3002,7 @@ void loop() {
       if (indiceMascotaActual < 0 || indiceMascotaActual >= numMascotas) {
         Serial.println("UID NO REGISTRADO");
         imprimirUID(uidLeido);
-        encolarEvento(uidLeido, EVT_UID_NO_REGISTRADO);
+        registrarRechazo(uidLeido, EVT_UID_NO_REGISTRADO);
         hayUIDLeido = false;
         estadoActual = BLOQUEADO;
         break;
@@ -902,21 +3011,39 @@ void loop() {
       int idx = -1;
       ResultadoValidacion res = validarVentana(mascotas[indiceMascotaActual], hora, idx);
 
+      if (res == VALIDACION_OK && prePorcionLista) {
+        // la cámara ya tiene comida: solo se entrega a su dueño, o a esta
+        // mascota si la porción quedó sin dueño y no supera su objetivo
+        revisarPrePorcion();
+        int dueno = duenoPrePorcion();
+        if (dueno < 0 && prePorcionSirveA(indiceMascotaActual, hora)) {
+          asignarPrePorcion(indiceMascotaActual);
+          dueno = indiceMascotaActual;
+        }
+        if (dueno != indiceMascotaActual) {
+          Serial.println("Camara ocupada con la pre-porcion de otra mascota");
+          registrarRechazo(uidLeido, EVT_CAMARA_OCUPADA);
+          hayUIDLeido = false;
+          estadoActual = BLOQUEADO;
+          break;
+        }
+      }
+
       if (res == VALIDACION_OK) {
         matchedWindowIndex = idx;
         Serial.print("Validado. Ventana index: ");
         Serial.println(matchedWindowIndex);
-        encolarEvento(uidLeido, EVT_DOSIFICANDO);
+        limpiarRechazo(uidLeido);
         estadoActual = DOSIFICANDO;
         break;
       }
 
       if (res == YA_COMIO_HOY) {
         Serial.println(" La mascota YA COMIÓ en esta ventana hoy");
-        encolarEvento(uidLeido, EVT_YA_COMIO_HOY);
+        registrarRechazo(uidLeido, EVT_YA_COMIO_HOY);
       } else if (res == FUERA_DE_HORARIO) {
         Serial.println(" Fuera del horario de alimentación");
-        encolarEvento(uidLeido, EVT_FUERA_HORARIO);
+        registrarRechazo(uidLeido, EVT_FUERA_HORARIO);
       }
 
       hayUIDLeido = false;
@@ -925,41 +3052,40 @@ void loop() {
     }
 
     case DOSIFICANDO: {
+      // La cámara debe estar cerrada y vacía antes de volver a dosificar
+      if (liberacionEnCurso()) {
+        if (tEsperaPuerta2 == 0) tEsperaPuerta2 = millis();
+        break;
+      }
+      esperaPuerta2Sesion = tEsperaPuerta2 ? millis() - tEsperaPuerta2 : 0;
+
       digitalWrite(LED_VERDE, HIGH);
-      activarServos();
-      balanza.power_up();
-      delay(120);
 
       float objetivo = mascotas[indiceMascotaActual].pesoObjetivoKg;
-      unsigned long tInicio = millis();
-
-      while (true) {
-        if (!mqtt.connected()) {
-          Serial.println("MQTT desconectado durante dosificación, intentando reconectar...");
-          conectarMQTT();
-        }
-        mqtt.loop();
-
-        abrirPuerta1Lento();
-        delay(TIEMPO_ABIERTO_MS);
-        cerrarPuerta1Lento();
+      float peso = 0.0;
 
-        mqtt.loop();
-        delay(TIEMPO_ESTABLE_MS);
-
-        float peso = leerPesoKg();
-        Serial.print("Peso: ");
-        Serial.println(peso, 3);
-
-        if (peso >= (objetivo - MARGEN_CORTE_ANTICIPADO_KG)) {
-          Serial.println("Peso objetivo alcanzado.");
-          break;
-        }
-        if (millis() - tInicio > TIMEOUT_DOSIFICACION_MS) {
-          Serial.println("Timeout de dosificación.");
-          break;
-        }
+      // VALIDANDO solo llega aquí con pre-porción si es de esta mascota y no supera su objetivo
+      if (prePorcionLista && prePorcionKg >= (objetivo - MARGEN_CORTE_ANTICIPADO_KG)) {
+        // Porción ya pesada: solo hace falta abrir puerta 2
+        activarServoPuerta2();
+        peso = prePorcionKg;
+      } else {
+        activarServos();
+        balanza.power_up();
+        delay(120);
+        if (!prePorcionLista) compensarDeriva();
+        // con pre-porción más chica solo se completa la diferencia
+        float inicial = prePorcionLista ? leerPesoKg() : 0.0;
+        peso = dosificar(objetivo, inicial, mascotas[indiceMascotaActual].modoDosificacion);
       }
+      prePorcionLista = false;
+      prePorcionConDueno = false;
+
+      // El evento se encola al terminar para llevar los gramos realmente dispensados
+      uint16_t gramos = (uint16_t)(peso > 0 ? peso * 1000.0f + 0.5f : 0);
+      encolarEvento(uidLeido, EVT_DOSIFICANDO, gramos);
+      gramosHoy[indiceMascotaActual] += gramos;
+      generacionRespuestas++;
 
       if (matchedWindowIndex >= 0 && matchedWindowIndex < mascotas[indiceMascotaActual].numVentanas) {
         mascotas[indiceMascotaActual].ventanas[matchedWindowIndex].yaAlimentoHoy = true;
@@ -978,18 +3104,21 @@ void loop() {
       }
       matchedWindowIndex = -1;
 
-      balanza.power_down();
+      // la balanza queda encendida: la liberación la usa para cerrar puerta 2
       estadoActual = LIBERANDO;
       break;
     }
 
     case LIBERANDO: {
       digitalWrite(LED_VERDE, LOW);
-      abrirPuerta2();
-      delay(5000);
-      cerrarPuerta2();
-      delay(600);
-      desactivarServos();
+      iniciarLiberacion(uidLeido);
+
+      uint32_t sesionMs = millis() - tInicioSesion;
+      tiemposSesion.sesiones++;
+      tiemposSesion.sumaSesionMs += sesionMs;
+      tiemposSesion.sumaEsperaPuerta2Ms += esperaPuerta2Sesion;
+      Serial.printf("Sesion: %lu ms desde el tap (espera puerta 2: %lu ms)\n",
+                    (unsigned long)sesionMs, (unsigned long)esperaPuerta2Sesion);
 
       hayUIDLeido = false;
       indiceMascotaActual = -1;
@@ -998,9 +3127,16 @@ void loop() {
     }
 
     case BLOQUEADO: {
-      digitalWrite(LED_ROJO, HIGH);
-      delay(LED_ROJO_NO_AUT_MS);
+      // Espera no bloqueante para no frenar una liberación en curso
+      if (!bloqueoIniciado) {
+        digitalWrite(LED_ROJO, HIGH);
+        tInicioBloqueo = millis();
+        bloqueoIniciado = true;
+        break;
+      }
+      if (millis() - tInicioBloqueo < duracionBloqueo) break;
       digitalWrite(LED_ROJO, LOW);
+      bloqueoIniciado = false;
 
       if (indiceMascotaActual < 0 || indiceMascotaActual >= numMascotas) {
         Serial.println("UID NO REGISTRADO");
@@ -1013,6 +3149,9 @@ void loop() {
       break;
     }
   } // switch
+  plazoTerminar();
+
+  if (estadoActual != estadoPrevio) traceRegistrar(TR_ESTADO, estadoActual, estadoPrevio);
 
   // Mantener MQTT y procesar loop
   if (!mqtt.connected()) {
@@ -1023,12 +3162,7 @@ void loop() {
 
   if (millis() - ultimoEnvioMQTT >= INTERVALO_ENVIO_MQTT_MS) {
     ultimoEnvioMQTT = millis();
-
-    if (mqtt.connected()) {
-      enviarColaPorEventos();
-      Serial.println("Datos enviados");
-    } else {
-      Serial.println("MQTT sigue desconectado, no se pudo enviar");
-    }
+    solicitarEventos();
   }
+  atenderSalida(); // toda publicación sale por los carriles
 }
@@ -0,0 +1,149 @@
+// pio test -e native -f test_balanza
+#include <unity.h>
+#include <Balanza.h>
+
+static const float FACTOR = 21000.0f;   // cuentas/kg, como CALIBRATION_FACTOR
+static const uint8_t CAP = 8;           // HIST_TARA
+
+static PuntoCalibracion puntos[4];
+static uint8_t numPuntos = 0;
+static MuestraTara hist[CAP];
+
+// Registra una tara en el anillo como registrarTara()
+static void tarar(uint8_t &head, uint8_t &count, uint32_t tSeg, int32_t offset) {
+  MuestraTara &m = hist[(head + count) % CAP];
+  if (count < CAP) {
+    count++;
+  } else {
+    head = (head + 1) % CAP;
+  }
+  m.tSeg = tSeg;
+  m.epoch = 0;
+  m.offset = offset;
+}
+
+void setUp(void) {
+  numPuntos = 0;
+}
+
+void tearDown(void) {}
+
+void test_sin_puntos_usa_el_factor(void) {
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.5f, balanzaKgDesdeCrudo(puntos, 0, 10500.0f, FACTOR));
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, -0.1f, balanzaKgDesdeCrudo(puntos, 0, -2100.0f, FACTOR));
+}
+
+void test_un_punto_es_recta_por_el_origen(void) {
+  TEST_ASSERT_TRUE(balanzaAgregarPunto(puntos, numPuntos, 4, 20000.0f, 1.0f));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 0.5f, balanzaKgDesdeCrudo(puntos, numPuntos, 10000.0f, FACTOR));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 1.0f, balanzaKgDesdeCrudo(puntos, numPuntos, 20000.0f, FACTOR));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 2.0f, balanzaKgDesdeCrudo(puntos, numPuntos, 40000.0f, FACTOR));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 0.0f, balanzaKgDesdeCrudo(puntos, numPuntos, 0.0f, FACTOR));
+}
+
+void test_interpola_por_tramos(void) {
+  // celda no lineal: 0.5 kg = 10000, 1 kg = 21000, 2 kg = 44000
+  balanzaAgregarPunto(puntos, numPuntos, 4, 21000.0f, 1.0f);
+  balanzaAgregarPunto(puntos, numPuntos, 4, 44000.0f, 2.0f);
+  balanzaAgregarPunto(puntos, numPuntos, 4, 10000.0f, 0.5f);
+  TEST_ASSERT_EQUAL_UINT8(3, numPuntos);
+  for (uint8_t i = 0; i < numPuntos; i++) {
+    TEST_ASSERT_FLOAT_WITHIN(1e-5, puntos[i].kg, balanzaKgDesdeCrudo(puntos, numPuntos, puntos[i].crudo, FACTOR));
+  }
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 0.25f, balanzaKgDesdeCrudo(puntos, numPuntos, 5000.0f, FACTOR));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 0.75f, balanzaKgDesdeCrudo(puntos, numPuntos, 15500.0f, FACTOR));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 1.5f, balanzaKgDesdeCrudo(puntos, numPuntos, 32500.0f, FACTOR));
+}
+
+void test_extrapola_con_el_tramo_extremo(void) {
+  balanzaAgregarPunto(puntos, numPuntos, 4, 10000.0f, 0.5f);
+  balanzaAgregarPunto(puntos, numPuntos, 4, 21000.0f, 1.0f);
+  // más allá del último: pendiente del tramo 10000..21000, no la del origen
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 1.5f, balanzaKgDesdeCrudo(puntos, numPuntos, 32000.0f, FACTOR));
+  // bajo cero (deriva negativa): pendiente del primer tramo
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, -0.05f, balanzaKgDesdeCrudo(puntos, numPuntos, -1000.0f, FACTOR));
+}
+
+void test_punto_casi_igual_reemplaza(void) {
+  balanzaAgregarPunto(puntos, numPuntos, 4, 20000.0f, 1.0f);
+  TEST_ASSERT_TRUE(balanzaAgregarPunto(puntos, numPuntos, 4, 20100.0f, 1.01f));  // por encima
+  TEST_ASSERT_TRUE(balanzaAgregarPunto(puntos, numPuntos, 4, 19950.0f, 0.99f));  // por debajo
+  TEST_ASSERT_EQUAL_UINT8(1, numPuntos);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.99f, puntos[0].kg);
+}
+
+void test_puntos_invalidos_o_tabla_llena(void) {
+  TEST_ASSERT_FALSE(balanzaAgregarPunto(puntos, numPuntos, 4, 0.0f, 1.0f));
+  TEST_ASSERT_FALSE(balanzaAgregarPunto(puntos, numPuntos, 4, 1000.0f, 0.0f));
+  for (uint8_t i = 1; i <= 4; i++) {
+    TEST_ASSERT_TRUE(balanzaAgregarPunto(puntos, numPuntos, 4, i * 10000.0f, i * 0.5f));
+  }
+  TEST_ASSERT_FALSE(balanzaAgregarPunto(puntos, numPuntos, 4, 55000.0f, 2.5f));
+  TEST_ASSERT_TRUE(balanzaAgregarPunto(puntos, numPuntos, 4, 40100.0f, 2.0f));   // reemplazo sí entra
+  TEST_ASSERT_EQUAL_UINT8(4, numPuntos);
+}
+
+void test_deriva_con_menos_de_dos_taras_es_cero(void) {
+  uint8_t head = 0, count = 0;
+  TEST_ASSERT_EQUAL_FLOAT(0.0f, balanzaPendienteDeriva(hist, head, count, CAP));
+  tarar(head, count, 100, 8000);
+  TEST_ASSERT_EQUAL_FLOAT(0.0f, balanzaPendienteDeriva(hist, head, count, CAP));
+}
+
+void test_deriva_mismo_tiempo_es_cero(void) {
+  uint8_t head = 0, count = 0;
+  tarar(head, count, 100, 8000);
+  tarar(head, count, 100, 8050);
+  TEST_ASSERT_EQUAL_FLOAT(0.0f, balanzaPendienteDeriva(hist, head, count, CAP));
+}
+
+void test_deriva_lineal_exacta(void) {
+  uint8_t head = 0, count = 0;
+  // 2 cuentas/s hacia abajo, taras irregulares
+  const uint32_t t[] = {50, 400, 1300, 2000, 3700};
+  for (uint8_t i = 0; i < 5; i++) tarar(head, count, t[i], 8000 - 2 * (int32_t)t[i]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, -2.0f, balanzaPendienteDeriva(hist, head, count, CAP));
+}
+
+void test_deriva_ajusta_ruido_por_minimos_cuadrados(void) {
+  uint8_t head = 0, count = 0;
+  // (0,0) (10,1) (20,4) (30,3): pendiente = (4*180 - 60*8) / (4*1400 - 3600) = 0.12
+  tarar(head, count, 1000, 5000);
+  tarar(head, count, 1010, 5001);
+  tarar(head, count, 1020, 5004);
+  tarar(head, count, 1030, 5003);
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 0.12f, balanzaPendienteDeriva(hist, head, count, CAP));
+}
+
+void test_deriva_con_anillo_dado_vuelta(void) {
+  uint8_t head = 0, count = 0;
+  // las 4 primeras tienen otra pendiente y salen del anillo
+  for (uint32_t i = 0; i < 4; i++) tarar(head, count, i * 100, 1000 + 50 * (int32_t)i);
+  for (uint32_t i = 0; i < CAP; i++) tarar(head, count, 1000 + i * 600, 3000 + 3 * (int32_t)(i * 600));
+  TEST_ASSERT_EQUAL_UINT8(4, head);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, 3.0f, balanzaPendienteDeriva(hist, head, count, CAP));
+}
+
+void test_deriva_cruzando_el_desborde_de_tseg(void) {
+  uint8_t head = 0, count = 0;
+  uint32_t t0 = 0xFFFFFF00UL;
+  for (uint32_t i = 0; i < 4; i++) tarar(head, count, t0 + i * 200, -500 + (int32_t)i * 100);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, 0.5f, balanzaPendienteDeriva(hist, head, count, CAP));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_sin_puntos_usa_el_factor);
+  RUN_TEST(test_un_punto_es_recta_por_el_origen);
+  RUN_TEST(test_interpola_por_tramos);
+  RUN_TEST(test_extrapola_con_el_tramo_extremo);
+  RUN_TEST(test_punto_casi_igual_reemplaza);
+  RUN_TEST(test_puntos_invalidos_o_tabla_llena);
+  RUN_TEST(test_deriva_con_menos_de_dos_taras_es_cero);
+  RUN_TEST(test_deriva_mismo_tiempo_es_cero);
+  RUN_TEST(test_deriva_lineal_exacta);
+  RUN_TEST(test_deriva_ajusta_ruido_por_minimos_cuadrados);
+  RUN_TEST(test_deriva_con_anillo_dado_vuelta);
+  RUN_TEST(test_deriva_cruzando_el_desborde_de_tseg);
+  return UNITY_END();
+}
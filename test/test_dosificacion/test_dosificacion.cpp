@@ -0,0 +1,243 @@
+// pio test -e native -f test_dosificacion
+#include <unity.h>
+#include <Dosificacion.h>
+#include <math.h>
+#include <stdint.h>
+
+static const float MARGEN_KG = MARGEN_CORTE_DEFECTO_KG;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_caudal_sigue_una_rampa(void) {
+  LazoContinuo l;
+  lazoIniciar(l, 0.0);
+  // 20 g/s constantes, lecturas cada 100 ms
+  for (int i = 1; i <= 60; i++) lazoMedir(l, 0.002f * i, 0.1f, CONT_ALFA_PESO, CONT_ALFA_CAUDAL);
+  TEST_ASSERT_FLOAT_WITHIN(0.0005, 0.020f, l.caudal);
+  // el filtro atrasa el peso un tramo fijo, no acumula error
+  TEST_ASSERT_FLOAT_WITHIN(0.0005, 0.120f - 0.002f * (1 - CONT_ALFA_PESO) / CONT_ALFA_PESO, l.pesoFiltrado);
+}
+
+void test_caudal_no_es_negativo(void) {
+  LazoContinuo l;
+  lazoIniciar(l, 0.050);
+  lazoMedir(l, 0.040, 0.1f, CONT_ALFA_PESO, CONT_ALFA_CAUDAL);   // golpe o vibración
+  TEST_ASSERT_EQUAL_FLOAT(0.0f, l.caudal);
+  lazoMedir(l, 0.041, 0.0f, CONT_ALFA_PESO, CONT_ALFA_CAUDAL);   // dt 0: no divide
+  TEST_ASSERT_EQUAL_FLOAT(0.0f, l.caudal);
+}
+
+void test_corte_anticipa_la_masa_en_vuelo(void) {
+  LazoContinuo l = {0.080f, 0.020f};
+  // faltan 20 g; en vuelo 20 g/s * 0.4 s = 8 g -> todavía no
+  TEST_ASSERT_FALSE(lazoDebeCortar(l, 0.100f, 0.4f, MARGEN_KG));
+  l.pesoFiltrado = 0.090f;   // faltan 10 g = 8 en vuelo + 2 de margen
+  TEST_ASSERT_TRUE(lazoDebeCortar(l, 0.100f, 0.4f, MARGEN_KG));
+  // sin caudal solo cuenta el margen
+  LazoContinuo quieto = {0.097f, 0.0f};
+  TEST_ASSERT_FALSE(lazoDebeCortar(quieto, 0.100f, 0.4f, MARGEN_KG));
+}
+
+void test_apertura_acotada(void) {
+  LazoContinuo l = {0.0f, 0.0f};
+  // faltan 45 g en 1.5 s = 30 g/s con 30 g/s a puerta abierta -> 1
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 1.0f, lazoApertura(l, 0.045f, CONT_TAU_S, 0.03f, CONT_APERTURA_MIN));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 0.5f, lazoApertura(l, 0.0225f, CONT_TAU_S, 0.03f, CONT_APERTURA_MIN));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 1.0f, lazoApertura(l, 0.500f, CONT_TAU_S, 0.03f, CONT_APERTURA_MIN));
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, CONT_APERTURA_MIN, lazoApertura(l, 0.001f, CONT_TAU_S, 0.03f, CONT_APERTURA_MIN));
+}
+
+void test_aprende_caudal_solo_con_puerta_abierta_y_flujo(void) {
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.03f, aprenderCaudalPorApertura(0.03f, 0.02f, 0.10f, CONT_APERTURA_MIN));
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.03f, aprenderCaudalPorApertura(0.03f, 0.0001f, 0.5f, CONT_APERTURA_MIN));
+  // 25 g/s a media apertura -> 50 g/s a puerta abierta; se acerca un 20%
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.034f, aprenderCaudalPorApertura(0.03f, 0.025f, 0.5f, CONT_APERTURA_MIN));
+}
+
+void test_latencia_se_corrige_hacia_la_observada(void) {
+  // cayeron 12 g más a 20 g/s -> 0.6 s observados; 0.4 + 0.3 * 0.2
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 0.46f, corregirLatencia(0.4f, 0.112f, 0.100f, 0.020f));
+}
+
+void test_latencia_ignora_observaciones_absurdas(void) {
+  TEST_ASSERT_EQUAL_FLOAT(0.4f, corregirLatencia(0.4f, 0.100f, 0.100f, 0.020f));   // nada en vuelo
+  TEST_ASSERT_EQUAL_FLOAT(0.4f, corregirLatencia(0.4f, 0.095f, 0.100f, 0.020f));   // bajó
+  TEST_ASSERT_EQUAL_FLOAT(0.4f, corregirLatencia(0.4f, 0.200f, 0.100f, 0.020f));   // 5 s
+  TEST_ASSERT_EQUAL_FLOAT(0.4f, corregirLatencia(0.4f, 0.110f, 0.100f, 0.0005f));  // sin caudal
+}
+
+void test_angulo_de_puerta1(void) {
+  TEST_ASSERT_EQUAL_INT(PUERTA1_CERRADA, anguloPuerta1(0.0f));
+  TEST_ASSERT_EQUAL_INT(PUERTA1_ABIERTA, anguloPuerta1(1.0f));
+  TEST_ASSERT_EQUAL_INT(67, anguloPuerta1(0.5f));   // 22.5 redondea a 23
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.5f, aperturaPuerta1(67) - 0.5f / 45.0f);
+}
+
+void test_servo_avanza_de_a_pasos_acotados(void) {
+  DosisContinua d;
+  dosisIniciar(d, 0.500f, 0.0);   // falta mucho: pide la puerta abierta
+  TEST_ASSERT_EQUAL_INT(PUERTA1_CERRADA - CONT_PASO_MAX_GRADOS, dosisAngulo(d, 0.03f));
+  TEST_ASSERT_EQUAL_INT(PUERTA1_CERRADA - 2 * CONT_PASO_MAX_GRADOS, dosisAngulo(d, 0.03f));
+  TEST_ASSERT_EQUAL_INT(PUERTA1_CERRADA - 3 * CONT_PASO_MAX_GRADOS, dosisAngulo(d, 0.03f));
+  d.lazo.pesoFiltrado = 0.499f;   // casi lleno: cierra hacia la apertura mínima, también de a pasos
+  TEST_ASSERT_EQUAL_INT(PUERTA1_CERRADA - 2 * CONT_PASO_MAX_GRADOS, dosisAngulo(d, 0.03f));
+  TEST_ASSERT_EQUAL_INT(anguloPuerta1(CONT_APERTURA_MIN), dosisAngulo(d, 0.03f));
+}
+
+// Tolva simulada en pasos de 10 ms: el caudal es proporcional a la apertura y
+// lo que sale de la puerta llega a la cámara 'latenciaReal' segundos después.
+struct Tolva {
+  float caudalAbierta;   // kg/s con la puerta totalmente abierta
+  float latenciaReal;    // s
+  float enVuelo[256];    // kg que salieron en cada paso de 10 ms
+  int paso;
+  float enCamara;
+};
+
+static void tick(Tolva &t, float apertura) {
+  const int pasosVuelo = (int)(t.latenciaReal / 0.01f + 0.5f);
+  t.enVuelo[t.paso % 256] = t.caudalAbierta * apertura * 0.01f;
+  int llega = t.paso - pasosVuelo;
+  if (llega >= 0) t.enCamara += t.enVuelo[llega % 256];
+  t.paso++;
+}
+
+// 100 ms (una muestra del HX711 a 10 SPS) con la misma apertura
+static float avanzar(Tolva &t, float apertura) {
+  for (int i = 0; i < 10; i++) tick(t, apertura);
+  return t.enCamara;
+}
+
+static void vaciarVuelo(Tolva &t) {
+  for (int i = 0; i < 300; i++) tick(t, 0.0);   // puerta cerrada: cae lo que estaba en vuelo
+}
+
+// Defaults de tiempo_abierto_ms, tiempo_estable_ms y timeout_dosificacion_ms
+static const uint32_t ABIERTO_MS = 200;
+static const uint32_t ESTABLE_MS = 700;
+static const uint32_t TIMEOUT_MS = 20000;
+
+// Pulsos como dosificarHasta(): rampa de apertura, ABIERTO_MS, rampa de
+// cierre, ESTABLE_MS y lectura; suma a 'ms' el tiempo usado
+static void pulsos(Tolva &t, float objetivo, uint32_t presupuestoMs, uint32_t &ms) {
+  if (t.enCamara >= objetivo - MARGEN_KG) return;
+  uint32_t usado = 0;
+  while (true) {
+    for (int a = PUERTA1_CERRADA; a >= PUERTA1_ABIERTA; a--) { tick(t, aperturaPuerta1(a)); usado += PUERTA1_PASO_MS; }
+    for (uint32_t i = 0; i < ABIERTO_MS; i += 10) { tick(t, 1.0f); usado += 10; }
+    for (int a = PUERTA1_ABIERTA; a <= PUERTA1_CERRADA; a++) { tick(t, aperturaPuerta1(a)); usado += PUERTA1_PASO_MS; }
+    for (uint32_t i = 0; i < ESTABLE_MS; i += 10) { tick(t, 0.0f); usado += 10; }
+    if (t.enCamara >= objetivo - MARGEN_KG || usado > presupuestoMs) break;
+  }
+  ms += usado;
+}
+
+// Una dosis completa con los pasos de DosisContinua, como dosificarContinuo();
+// suma a 'ms' el tiempo hasta la lectura final
+static float dosis(Tolva &t, float objetivo, float &latencia, float &caudalPorApertura, uint32_t &ms) {
+  t.paso = 0;
+  t.enCamara = 0.0;
+  DosisContinua d;
+  dosisIniciar(d, objetivo, 0.0);
+  for (int i = 0; i < 300; i++) {
+    if (dosisDebeCortar(d, latencia, MARGEN_KG)) break;
+    int angulo = dosisAngulo(d, caudalPorApertura);
+    float peso = avanzar(t, aperturaPuerta1(angulo));
+    caudalPorApertura = dosisMedir(d, peso, 0.1f, caudalPorApertura, latencia);
+    ms += 100;
+  }
+  for (uint32_t i = 0; i < ESTABLE_MS; i += 10) tick(t, 0.0f);
+  ms += ESTABLE_MS;
+  vaciarVuelo(t);
+  latencia = corregirLatencia(latencia, t.enCamara, d.pesoAlCorte, d.caudalAlCorte);
+  return t.enCamara;
+}
+
+static float dosis(Tolva &t, float objetivo, float &latencia, float &caudalPorApertura) {
+  uint32_t ms = 0;
+  return dosis(t, objetivo, latencia, caudalPorApertura, ms);
+}
+
+void test_caudal_por_apertura_converge_con_apertura_fija(void) {
+  Tolva t = {};
+  t.caudalAbierta = 0.05f;
+  t.latenciaReal = 0.6f;
+  LazoContinuo l;
+  lazoIniciar(l, 0.0);
+  float caudalPorApertura = 0.03f;
+  for (int i = 0; i < 60; i++) {
+    lazoMedir(l, avanzar(t, 0.5f), 0.1f, CONT_ALFA_PESO, CONT_ALFA_CAUDAL);
+    caudalPorApertura = aprenderCaudalPorApertura(caudalPorApertura, l.caudal, 0.5f, CONT_APERTURA_MIN);
+  }
+  TEST_ASSERT_FLOAT_WITHIN(0.002, 0.05f, caudalPorApertura);
+}
+
+void test_dosis_simulada_cerca_del_objetivo_y_latencia_aprendida(void) {
+  Tolva t = {};
+  t.caudalAbierta = 0.05f;
+  t.latenciaReal = 0.6f;
+  float latencia = 0.4f, caudalPorApertura = 0.03f;
+  for (int i = 0; i < 10; i++) {
+    float peso = dosis(t, 0.100f, latencia, caudalPorApertura);
+    TEST_ASSERT_FLOAT_WITHIN(0.005, 0.100f, peso);
+    TEST_ASSERT_TRUE(latencia < 0.6f + 0.05f);   // Unity compara GREATER/LESS_THAN como enteros
+  }
+  // arrancó corta (0.4 s) y se acercó a la real
+  TEST_ASSERT_TRUE(latencia > 0.45f);
+}
+
+// Misma tolva y mismos objetivos con las dos estrategias, como dosificar():
+// el continuo completa con pulsos si queda corto, dentro del mismo timeout
+void test_continuo_vs_pulsos_tiempo_y_error(void) {
+  const float objetivos[] = {0.030f, 0.055f, 0.080f, 0.120f, 0.150f};
+  const int n = sizeof(objetivos) / sizeof(objetivos[0]);
+  Tolva t = {};
+  t.caudalAbierta = 0.05f;
+  t.latenciaReal = 0.6f;
+  float latencia = 0.4f, caudalPorApertura = 0.03f;
+  for (int i = 0; i < 5; i++) dosis(t, 0.100f, latencia, caudalPorApertura);   // ya aprendió
+
+  uint32_t msPulsos = 0, msContinuo = 0;
+  float errPulsos = 0.0, errContinuo = 0.0, peorContinuo = 0.0;
+  for (int i = 0; i < n; i++) {
+    float objetivo = objetivos[i];
+    Tolva p = t;
+    p.paso = 0;
+    p.enCamara = 0.0;
+    pulsos(p, objetivo, TIMEOUT_MS, msPulsos);
+    vaciarVuelo(p);
+    errPulsos += fabsf(p.enCamara - objetivo);
+
+    uint32_t ms = 0;
+    dosis(t, objetivo, latencia, caudalPorApertura, ms);
+    if (ms < TIMEOUT_MS) pulsos(t, objetivo, TIMEOUT_MS - ms, ms);
+    vaciarVuelo(t);
+    msContinuo += ms;
+    float err = fabsf(t.enCamara - objetivo);
+    errContinuo += err;
+    if (err > peorContinuo) peorContinuo = err;
+  }
+  // pulsos de ~33 g: error medio ~12 g en ~5.5 s; continuo: < 1 g en ~3.2 s
+  TEST_ASSERT_TRUE(peorContinuo < 0.005f);
+  TEST_ASSERT_TRUE(errContinuo < errPulsos / 4);
+  TEST_ASSERT_TRUE(msContinuo * 4 < msPulsos * 3);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_caudal_sigue_una_rampa);
+  RUN_TEST(test_caudal_no_es_negativo);
+  RUN_TEST(test_corte_anticipa_la_masa_en_vuelo);
+  RUN_TEST(test_apertura_acotada);
+  RUN_TEST(test_aprende_caudal_solo_con_puerta_abierta_y_flujo);
+  RUN_TEST(test_latencia_se_corrige_hacia_la_observada);
+  RUN_TEST(test_latencia_ignora_observaciones_absurdas);
+  RUN_TEST(test_angulo_de_puerta1);
+  RUN_TEST(test_servo_avanza_de_a_pasos_acotados);
+  RUN_TEST(test_caudal_por_apertura_converge_con_apertura_fija);
+  RUN_TEST(test_dosis_simulada_cerca_del_objetivo_y_latencia_aprendida);
+  RUN_TEST(test_continuo_vs_pulsos_tiempo_y_error);
+  return UNITY_END();
+}
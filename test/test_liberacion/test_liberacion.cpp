@@ -0,0 +1,144 @@
+// pio test -e native -f test_liberacion
+#include <unity.h>
+#include <Liberacion.h>
+
+static const float UMBRAL_KG = 0.005;     // default de liberacion_vacio_kg
+static const uint32_t TOPE_MS = 5000;     // default de tiempo_puerta2_ms
+static const uint32_t MUESTRA_MS = 100;   // HX711 a 10 SPS
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+// Cámara simulada: la porción empieza a caer cuando la puerta terminó de
+// abrir y se vacía a caudal constante; 'queda' no cae nunca (atasco)
+struct Camara {
+  float porcion;
+  float queda;
+  uint32_t inicioCaidaMs;
+  float caudalKgS;
+};
+
+static float pesoCamara(const Camara &c, uint32_t abiertaMs) {
+  float cayo = 0.0;
+  if (abiertaMs > c.inicioCaidaMs) cayo = c.caudalKgS * (abiertaMs - c.inicioCaidaMs) / 1000.0f;
+  float p = c.porcion - cayo;
+  return p < c.queda ? c.queda : p;
+}
+
+// Corre una liberación hasta que decide cerrar; 'conBalanza' = false simula un
+// HX711 que no entrega muestras. Devuelve cuánto estuvo abierta.
+static uint32_t liberar(const Camara &c, bool conBalanza, Liberacion &l, CierreLiberacion &cierre,
+                        uint32_t t0 = 1000) {
+  liberacionIniciar(l, t0);
+  for (uint32_t t = t0;; t += 10) {
+    if (conBalanza && (t - t0) % MUESTRA_MS == 0 && liberacionMideAhora(l, t)) {
+      liberacionMuestra(l, pesoCamara(c, t - t0), t, UMBRAL_KG);
+    }
+    cierre = liberacionDecidir(l, t, TOPE_MS);
+    if (cierre != LIB_SEGUIR) return t - t0;
+  }
+}
+
+static const Camara PORCION_20G = {0.020f, 0.0f, 200, 0.060f};
+
+void test_cierra_al_quedar_vacia(void) {
+  Liberacion l;
+  CierreLiberacion cierre;
+  uint32_t abierta = liberar(PORCION_20G, true, l, cierre);
+  TEST_ASSERT_EQUAL(LIB_CIERRE_VACIA, cierre);
+  // cae en ~530 ms, el promedio baja del umbral un par de muestras después
+  TEST_ASSERT_LESS_THAN(1500, abierta);
+  TEST_ASSERT_GREATER_THAN(LIB_MIN_ABIERTA_MS + LIB_VACIO_ESTABLE_MS, abierta);
+  TEST_ASSERT_TRUE(liberacionVioVacia(l, UMBRAL_KG));
+  TEST_ASSERT_FALSE(liberacionAtascada(l, UMBRAL_KG));
+}
+
+void test_atasco_al_tope(void) {
+  Camara c = PORCION_20G;
+  c.queda = 0.008f;
+  Liberacion l;
+  CierreLiberacion cierre;
+  TEST_ASSERT_EQUAL_UINT32(TOPE_MS, liberar(c, true, l, cierre));
+  TEST_ASSERT_EQUAL(LIB_CIERRE_TOPE, cierre);
+  TEST_ASSERT_TRUE(liberacionAtascada(l, UMBRAL_KG));
+  TEST_ASSERT_FALSE(liberacionVioVacia(l, UMBRAL_KG));
+}
+
+void test_sin_lecturas_cierra_por_tiempo_sin_atasco(void) {
+  Liberacion l;
+  CierreLiberacion cierre;
+  TEST_ASSERT_EQUAL_UINT32(TOPE_MS, liberar(PORCION_20G, false, l, cierre));
+  TEST_ASSERT_EQUAL(LIB_CIERRE_TOPE, cierre);
+  TEST_ASSERT_FALSE(liberacionAtascada(l, UMBRAL_KG));
+  TEST_ASSERT_FALSE(liberacionVioVacia(l, UMBRAL_KG));
+}
+
+void test_un_golpe_no_vacia_la_camara(void) {
+  Liberacion l;
+  liberacionIniciar(l, 0);
+  liberacionMuestra(l, 0.020f, 300, UMBRAL_KG);
+  liberacionMuestra(l, 0.020f, 400, UMBRAL_KG);
+  liberacionMuestra(l, -0.010f, 500, UMBRAL_KG);   // la puerta golpea la celda
+  TEST_ASSERT_FALSE(l.vacia);
+  TEST_ASSERT_EQUAL(LIB_SEGUIR, liberacionDecidir(l, 1000, TOPE_MS));
+}
+
+void test_vacio_debe_sostenerse(void) {
+  Liberacion l;
+  liberacionIniciar(l, 0);
+  for (uint32_t t = 300; t <= 500; t += 100) liberacionMuestra(l, 0.0f, t, UMBRAL_KG);
+  TEST_ASSERT_TRUE(l.vacia);
+  TEST_ASSERT_EQUAL(LIB_SEGUIR, liberacionDecidir(l, 300 + LIB_VACIO_ESTABLE_MS - 1, TOPE_MS));
+  TEST_ASSERT_EQUAL(LIB_CIERRE_VACIA, liberacionDecidir(l, 300 + LIB_VACIO_ESTABLE_MS, TOPE_MS));
+  // vuelve a subir (se reacomodó comida): el conteo empieza de nuevo
+  for (uint32_t t = 600; t <= 800; t += 100) liberacionMuestra(l, 0.030f, t, UMBRAL_KG);
+  TEST_ASSERT_FALSE(l.vacia);
+  TEST_ASSERT_EQUAL(LIB_SEGUIR, liberacionDecidir(l, 900, TOPE_MS));
+}
+
+void test_desborde_de_millis(void) {
+  Liberacion l;
+  CierreLiberacion cierre;
+  uint32_t abierta = liberar(PORCION_20G, true, l, cierre, 0xFFFFFF00UL);
+  TEST_ASSERT_EQUAL(LIB_CIERRE_VACIA, cierre);
+  TEST_ASSERT_LESS_THAN(1500, abierta);
+}
+
+// Mascotas por hora con una fila de mascotas esperando: la siguiente se valida
+// mientras cae la porción anterior, pero DOSIFICANDO espera a que puerta 2
+// cierre (atenderLiberacion), así que el ciclo es dosis + liberación + cierre.
+static float mascotasPorHora(bool conBalanza, uint32_t dosisMs) {
+  const uint32_t mascotas = 60;
+  uint64_t t = 0;
+  for (uint32_t i = 0; i < mascotas; i++) {
+    Liberacion l;
+    CierreLiberacion cierre;
+    t += dosisMs;
+    t += liberar(PORCION_20G, conBalanza, l, cierre);
+    t += TIEMPO_CIERRE_PUERTA2_MS;
+  }
+  return mascotas * 3600000.0f / (float)t;
+}
+
+void test_throughput_cierre_por_vacio_vs_tope_fijo(void) {
+  const uint32_t dosisMs = 4000;   // unos 3 pulsos de 200 + 700 ms con servo lento
+  float porVacio = mascotasPorHora(true, dosisMs);
+  float porTope = mascotasPorHora(false, dosisMs);
+  // tope fijo: 4 + 5 + 0.6 s por mascota
+  TEST_ASSERT_FLOAT_WITHIN(1.0f, 3600.0f / 9.6f, porTope);
+  TEST_ASSERT_TRUE(porVacio > 500.0f);
+  TEST_ASSERT_TRUE(porVacio > porTope * 1.5f);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_cierra_al_quedar_vacia);
+  RUN_TEST(test_atasco_al_tope);
+  RUN_TEST(test_sin_lecturas_cierra_por_tiempo_sin_atasco);
+  RUN_TEST(test_un_golpe_no_vacia_la_camara);
+  RUN_TEST(test_vacio_debe_sostenerse);
+  RUN_TEST(test_desborde_de_millis);
+  RUN_TEST(test_throughput_cierre_por_vacio_vs_tope_fijo);
+  return UNITY_END();
+}
@@ -0,0 +1,265 @@
+// pio test -e native -f test_pendientes
+#include <unity.h>
+#include <string.h>
+#include <Pendientes.h>
+
+struct Visto : EntradaVisto {
+  uint8_t rechazos;
+};
+
+static Visto vistos[4];
+static ColaPendientes<4> cola;
+static int desalojados = 0;
+static uint8_t ultimoDesalojado = 0;
+static uint8_t prioridades[256];   // prioridad por primer byte del UID
+
+static void alDesalojar(Visto &v) {
+  desalojados++;
+  ultimoDesalojado = v.uid[0];
+}
+
+static uint8_t prioridad(const Pendiente &p) { return prioridades[p.uid[0]]; }
+
+static ResultadoTarjeta encolar(const uint8_t* uid, uint32_t ahora) {
+  return encolarTarjeta(cola, uid, ahora, [ahora](const uint8_t* u) -> Visto& {
+    return obtenerEnVistos(vistos, u, ahora, RFID_VISTO_TTL_MS, alDesalojar);
+  });
+}
+
+static bool presentar(uint8_t id, uint32_t ahora) {
+  uint8_t uid[PENDIENTES_UID_SIZE] = {id, 0xA0, 0xB0, 0xC0};
+  return encolar(uid, ahora) == TARJETA_AGREGADA;
+}
+
+// Campo de un lector ISO14443A: REQA responde si hay alguna tarjeta en IDLE,
+// el Select elige la de UID menor (anticolisión) y HLTA la pasa a HALT. Una
+// tarjeta que sale del campo pierde el HALT.
+struct LectorSimulado {
+  enum Estado { FUERA, IDLE, HALT };
+  Estado estado[256];
+  uint8_t seleccionada;
+  uint8_t uidLeido[PENDIENTES_UID_SIZE];
+  bool falla;                // la anticolisión no termina (tarjetas mal acopladas)
+  uint32_t finalizados;
+
+  void poner(uint8_t id) { if (estado[id] == FUERA) estado[id] = IDLE; }
+  void sacar(uint8_t id) { estado[id] = FUERA; }
+
+  bool nuevaTarjeta() {
+    for (int id = 0; id < 256; id++) if (estado[id] == IDLE) return true;
+    return false;
+  }
+  bool leerUid() {
+    if (falla) return false;
+    for (int id = 0; id < 256; id++) {
+      if (estado[id] != IDLE) continue;
+      seleccionada = (uint8_t)id;
+      uint8_t uid[PENDIENTES_UID_SIZE] = {(uint8_t)id, 0xA0, 0xB0, 0xC0};
+      memcpy(uidLeido, uid, sizeof(uid));
+      return true;
+    }
+    return false;
+  }
+  const uint8_t* uid() const { return uidLeido; }
+  uint8_t uidSize() const { return PENDIENTES_UID_SIZE; }
+  void detener() { estado[seleccionada] = HALT; }
+  void finalizar() { finalizados++; }
+};
+
+static LectorSimulado rc;
+
+// Un barrido como escanearTarjetas() en main.cpp
+static uint8_t escanear(uint32_t ahora, uint32_t *aceptadas = nullptr) {
+  return escanearLector(rc, 4, [ahora, aceptadas](const uint8_t* uid, uint8_t) {
+    if (encolar(uid, ahora) == TARJETA_AGREGADA && aceptadas) (*aceptadas)++;
+  });
+}
+
+// Tarjetas que se quedan en el campo: barridos cada 100 ms
+static uint32_t lector(const uint8_t* ids, uint8_t n, uint32_t desde, uint32_t hasta) {
+  for (uint8_t i = 0; i < n; i++) rc.poner(ids[i]);
+  uint32_t aceptadas = 0;
+  for (uint32_t t = desde; t != hasta; t += 100) escanear(t, &aceptadas);
+  for (uint8_t i = 0; i < n; i++) rc.sacar(ids[i]);
+  return aceptadas;
+}
+
+static uint8_t tomar(void) {
+  uint8_t uid[PENDIENTES_UID_SIZE];
+  if (!cola.tomar(prioridad, uid)) return 0;
+  return uid[0];
+}
+
+void setUp(void) {
+  memset(vistos, 0, sizeof(vistos));
+  cola.n = 0;
+  desalojados = 0;
+  ultimoDesalojado = 0;
+  memset(prioridades, 0, sizeof(prioridades));
+  memset(&rc, 0, sizeof(rc));
+}
+
+void tearDown(void) {}
+
+void test_varias_tarjetas_entran_una_vez(void) {
+  const uint8_t ids[] = {1, 2, 3};
+  TEST_ASSERT_EQUAL_UINT32(3, lector(ids, 3, 0, 2000));
+  TEST_ASSERT_EQUAL_UINT8(3, cola.n);
+}
+
+void test_pendiente_no_se_duplica_tras_el_ttl_de_vistos(void) {
+  const uint8_t ids[] = {7};
+  // entra y sale del campo cada segundo; sigue en la cola: no se vuelve a agregar
+  for (uint32_t t = 0; t < 10000; t += 1000) lector(ids, 1, t, t + 500);
+  TEST_ASSERT_EQUAL_UINT8(1, cola.n);
+}
+
+void test_reaceptada_pasado_el_ttl_de_vistos(void) {
+  const uint8_t ids[] = {5};
+  TEST_ASSERT_EQUAL_UINT32(1, lector(ids, 1, 0, 500));
+  TEST_ASSERT_EQUAL_UINT8(5, tomar());
+  // recién atendida: rebotes del mismo tag dentro de 3 s se ignoran
+  TEST_ASSERT_EQUAL_UINT32(0, lector(ids, 1, 500, 2900));
+  TEST_ASSERT_TRUE(presentar(5, 3100));
+}
+
+void test_cola_llena_rechaza(void) {
+  const uint8_t ids[] = {1, 2, 3, 4};
+  lector(ids, 4, 0, 100);
+  uint8_t uid9[PENDIENTES_UID_SIZE] = {9, 0xA0, 0xB0, 0xC0};
+  TEST_ASSERT_EQUAL(TARJETA_COLA_LLENA, encolar(uid9, 200));
+  TEST_ASSERT_EQUAL_UINT8(4, cola.n);
+}
+
+void test_motivos_de_descarte(void) {
+  uint8_t uid[PENDIENTES_UID_SIZE] = {3, 0xA0, 0xB0, 0xC0};
+  TEST_ASSERT_EQUAL(TARJETA_AGREGADA, encolar(uid, 0));
+  TEST_ASSERT_EQUAL(TARJETA_YA_PENDIENTE, encolar(uid, 5000));
+  tomar();
+  TEST_ASSERT_EQUAL(TARJETA_AGREGADA, encolar(uid, 5000));   // visto en 0: fuera del TTL
+  tomar();
+  TEST_ASSERT_EQUAL(TARJETA_REBOTE, encolar(uid, 5000 + RFID_VISTO_TTL_MS - 1));
+}
+
+void test_purga_las_que_esperan_demasiado(void) {
+  TEST_ASSERT_TRUE(presentar(1, 0));
+  TEST_ASSERT_TRUE(presentar(2, 20000));
+  cola.purgar(PENDIENTE_TTL_MS, PENDIENTE_TTL_MS);
+  TEST_ASSERT_EQUAL_UINT8(2, cola.n);
+  cola.purgar(PENDIENTE_TTL_MS + 1, PENDIENTE_TTL_MS);
+  TEST_ASSERT_EQUAL_UINT8(1, cola.n);
+  TEST_ASSERT_EQUAL_UINT8(2, tomar());
+}
+
+void test_prioridad_y_empate_por_llegada(void) {
+  prioridades[1] = 1;
+  prioridades[2] = 3;
+  prioridades[3] = 1;
+  prioridades[4] = 3;
+  TEST_ASSERT_TRUE(presentar(3, 100));
+  TEST_ASSERT_TRUE(presentar(1, 200));
+  TEST_ASSERT_TRUE(presentar(4, 300));
+  TEST_ASSERT_TRUE(presentar(2, 400));
+  TEST_ASSERT_EQUAL_UINT8(4, tomar());
+  TEST_ASSERT_EQUAL_UINT8(2, tomar());
+  TEST_ASSERT_EQUAL_UINT8(3, tomar());
+  TEST_ASSERT_EQUAL_UINT8(1, tomar());
+  TEST_ASSERT_EQUAL_UINT8(0, tomar());
+}
+
+void test_empate_con_desborde_de_millis(void) {
+  const uint32_t casiFin = 0xFFFFFF00UL;
+  const uint8_t ids[] = {8, 9};
+  // 8 llega antes del desborde, 9 después; ambas con la misma prioridad
+  TEST_ASSERT_TRUE(presentar(8, casiFin));
+  TEST_ASSERT_TRUE(presentar(9, casiFin + 0x200));
+  TEST_ASSERT_EQUAL_UINT32(0, lector(ids, 2, casiFin + 0x300, casiFin + 0x300 + 1000));
+  cola.purgar(casiFin + 0x400, PENDIENTE_TTL_MS);   // cruzar el desborde no vence nada
+  TEST_ASSERT_EQUAL_UINT8(2, cola.n);
+  TEST_ASSERT_EQUAL_UINT8(8, tomar());
+  TEST_ASSERT_EQUAL_UINT8(9, tomar());
+}
+
+void test_cache_lleno_desaloja_la_mas_vieja(void) {
+  for (uint8_t id = 1; id <= 4; id++) {
+    TEST_ASSERT_TRUE(presentar(id, id * 1000));
+    tomar();
+  }
+  TEST_ASSERT_EQUAL_INT(0, desalojados);
+  TEST_ASSERT_TRUE(presentar(5, 10000));
+  TEST_ASSERT_EQUAL_INT(1, desalojados);
+  TEST_ASSERT_EQUAL_UINT8(1, ultimoDesalojado);
+  uint8_t uid1[PENDIENTES_UID_SIZE] = {1, 0xA0, 0xB0, 0xC0};
+  TEST_ASSERT_NULL(buscarEnVistos(vistos, uid1));
+}
+
+void test_entrada_nueva_limpia_los_datos_del_desalojado(void) {
+  for (uint8_t id = 1; id <= 4; id++) presentar(id, id * 1000);
+  uint8_t uid1[PENDIENTES_UID_SIZE] = {1, 0xA0, 0xB0, 0xC0};
+  buscarEnVistos(vistos, uid1)->rechazos = 9;
+  uint8_t uid[PENDIENTES_UID_SIZE] = {6, 0xA0, 0xB0, 0xC0};
+  Visto &v = obtenerEnVistos(vistos, uid, 20000, RFID_VISTO_TTL_MS, alDesalojar);
+  TEST_ASSERT_EQUAL_UINT8(0, v.rechazos);
+  TEST_ASSERT_FALSE(vistoReciente(v, 20000, RFID_VISTO_TTL_MS));
+}
+
+void test_barrido_lee_cada_tarjeta_una_vez_hasta_que_sale(void) {
+  rc.poner(3);
+  rc.poner(1);
+  rc.poner(2);
+  TEST_ASSERT_EQUAL_UINT8(3, escanear(0));
+  TEST_ASSERT_EQUAL_UINT32(1, rc.finalizados);
+  TEST_ASSERT_EQUAL_UINT8(0, escanear(100));   // todas en HALT
+  TEST_ASSERT_EQUAL_UINT32(1, rc.finalizados);  // sin lecturas no se toca Crypto1
+  rc.sacar(2);
+  rc.poner(2);                                  // vuelve al campo en IDLE
+  TEST_ASSERT_EQUAL_UINT8(1, escanear(200));
+}
+
+void test_barrido_acotado_sigue_en_el_proximo(void) {
+  for (uint8_t id = 1; id <= 6; id++) rc.poner(id);
+  TEST_ASSERT_EQUAL_UINT8(4, escanear(0));
+  TEST_ASSERT_EQUAL_UINT8(2, escanear(100));
+  TEST_ASSERT_EQUAL_UINT8(4, cola.n);           // la cola tiene 4 lugares
+}
+
+void test_falla_de_anticolision_corta_el_barrido(void) {
+  rc.poner(1);
+  rc.falla = true;
+  TEST_ASSERT_EQUAL_UINT8(0, escanear(0));
+  TEST_ASSERT_EQUAL_UINT32(0, rc.finalizados);
+  rc.falla = false;
+  TEST_ASSERT_EQUAL_UINT8(1, escanear(100));    // sigue en IDLE: entra en el próximo
+  TEST_ASSERT_EQUAL_UINT8(1, cola.n);
+}
+
+void test_rebote_al_salir_y_volver_no_se_encola(void) {
+  rc.poner(5);
+  uint32_t aceptadas = 0;
+  escanear(0, &aceptadas);
+  TEST_ASSERT_EQUAL_UINT8(5, tomar());
+  rc.sacar(5);
+  rc.poner(5);                                  // el collar se aleja y vuelve
+  TEST_ASSERT_EQUAL_UINT8(1, escanear(1000, &aceptadas));
+  TEST_ASSERT_EQUAL_UINT32(1, aceptadas);
+  TEST_ASSERT_EQUAL_UINT8(0, cola.n);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_varias_tarjetas_entran_una_vez);
+  RUN_TEST(test_pendiente_no_se_duplica_tras_el_ttl_de_vistos);
+  RUN_TEST(test_reaceptada_pasado_el_ttl_de_vistos);
+  RUN_TEST(test_cola_llena_rechaza);
+  RUN_TEST(test_motivos_de_descarte);
+  RUN_TEST(test_purga_las_que_esperan_demasiado);
+  RUN_TEST(test_prioridad_y_empate_por_llegada);
+  RUN_TEST(test_empate_con_desborde_de_millis);
+  RUN_TEST(test_cache_lleno_desaloja_la_mas_vieja);
+  RUN_TEST(test_entrada_nueva_limpia_los_datos_del_desalojado);
+  RUN_TEST(test_barrido_lee_cada_tarjeta_una_vez_hasta_que_sale);
+  RUN_TEST(test_barrido_acotado_sigue_en_el_proximo);
+  RUN_TEST(test_falla_de_anticolision_corta_el_barrido);
+  RUN_TEST(test_rebote_al_salir_y_volver_no_se_encola);
+  return UNITY_END();
+}
@@ -0,0 +1,116 @@
+// pio test -e native -f test_reloj
+#include <unity.h>
+#include <Reloj.h>
+
+static const int32_t GMT_EC = -5 * 3600;     // Ecuador
+static const uint32_t E_2024_03_10 = 1710028800UL;  // 2024-03-10 00:00:00 UTC
+
+static int cambiosDia = 0;
+static int32_t ultimoDiaCallback = -1;
+
+static void alCambiarDia(int32_t dia) {
+  cambiosDia++;
+  ultimoDiaCallback = dia;
+}
+
+static int32_t dia(uint32_t epochUtc, int32_t gmt, int32_t dst) {
+  return relojDiaLocal(relojALocal(epochUtc, gmt, dst));
+}
+
+void setUp(void) {
+  cambiosDia = 0;
+  ultimoDiaCallback = -1;
+}
+
+void tearDown(void) {}
+
+void test_epoch_desde_ancla_trunca_segundos(void) {
+  TEST_ASSERT_EQUAL_UINT32(E_2024_03_10, relojEpochDesdeAncla(E_2024_03_10, 5000000, 5999999));
+  TEST_ASSERT_EQUAL_UINT32(E_2024_03_10 + 1, relojEpochDesdeAncla(E_2024_03_10, 5000000, 6000000));
+  // 49 días de esp_timer: no se desborda como millis()
+  int64_t us49d = 49LL * 86400 * 1000000;
+  TEST_ASSERT_EQUAL_UINT32(E_2024_03_10 + 49UL * 86400, relojEpochDesdeAncla(E_2024_03_10, 0, us49d));
+}
+
+void test_dia_local_cambia_a_medianoche_local_no_utc(void) {
+  // 04:59:59 UTC = 23:59:59 del día anterior en GMT-5
+  uint32_t antes = relojALocal(E_2024_03_10 + 5 * 3600 - 1, GMT_EC, 0);
+  uint32_t despues = relojALocal(E_2024_03_10 + 5 * 3600, GMT_EC, 0);
+  TEST_ASSERT_EQUAL_INT32(relojDiaLocal(antes) + 1, relojDiaLocal(despues));
+  TEST_ASSERT_EQUAL_UINT16(1439, relojMinutoDelDia(antes));
+  TEST_ASSERT_EQUAL_UINT16(0, relojMinutoDelDia(despues));
+}
+
+void test_offset_dst_mueve_el_borde_del_dia(void) {
+  // con +1 h de verano el día local empieza una hora antes en UTC
+  uint32_t t = E_2024_03_10 + 4 * 3600 + 30 * 60;   // 04:30 UTC
+  TEST_ASSERT_EQUAL_UINT16(23 * 60 + 30, relojMinutoDelDia(relojALocal(t, GMT_EC, 0)));
+  TEST_ASSERT_EQUAL_UINT16(30, relojMinutoDelDia(relojALocal(t, GMT_EC, 3600)));
+  TEST_ASSERT_EQUAL_INT32(relojDiaLocal(relojALocal(t, GMT_EC, 0)) + 1,
+                          relojDiaLocal(relojALocal(t, GMT_EC, 3600)));
+}
+
+void test_offset_positivo(void) {
+  // GMT+9: 15:00 UTC ya es el día siguiente a las 00:00
+  uint32_t t = E_2024_03_10 + 15 * 3600;
+  TEST_ASSERT_EQUAL_UINT16(0, relojMinutoDelDia(relojALocal(t, 9 * 3600, 0)));
+  TEST_ASSERT_EQUAL_INT32(relojDiaLocal(E_2024_03_10) + 1, relojDiaLocal(relojALocal(t, 9 * 3600, 0)));
+}
+
+void test_callback_una_vez_por_dia(void) {
+  int32_t ultimo = -1;
+  uint32_t t0 = E_2024_03_10 + 5 * 3600 + 60;   // 00:01 local
+  relojNotificarDia(dia(t0, GMT_EC, 0), ultimo, alCambiarDia);   // primer día válido tras arrancar
+  TEST_ASSERT_EQUAL_INT(1, cambiosDia);
+  for (uint32_t s = 60; s < 86000; s += 600) relojNotificarDia(dia(t0 + s, GMT_EC, 0), ultimo, alCambiarDia);
+  TEST_ASSERT_EQUAL_INT(1, cambiosDia);
+  relojNotificarDia(dia(t0 + 86400, GMT_EC, 0), ultimo, alCambiarDia);
+  TEST_ASSERT_EQUAL_INT(2, cambiosDia);
+  TEST_ASSERT_EQUAL_INT32(relojDiaLocal(relojALocal(t0 + 86400, GMT_EC, 0)), ultimoDiaCallback);
+}
+
+void test_sin_hora_no_dispara(void) {
+  int32_t ultimo = -1;
+  TEST_ASSERT_FALSE(relojCambioDeDia(-1, ultimo));
+  TEST_ASSERT_EQUAL_INT32(-1, ultimo);
+}
+
+void test_sin_callback_igual_avanza_el_dia(void) {
+  int32_t ultimo = -1;
+  relojNotificarDia(dia(E_2024_03_10, GMT_EC, 0), ultimo, nullptr);   // antes de setup()
+  TEST_ASSERT_EQUAL_INT32(dia(E_2024_03_10, GMT_EC, 0), ultimo);
+  relojNotificarDia(dia(E_2024_03_10, GMT_EC, 0), ultimo, alCambiarDia);
+  TEST_ASSERT_EQUAL_INT(0, cambiosDia);
+}
+
+void test_salto_de_varios_dias_dispara_una_vez(void) {
+  int32_t ultimo = -1;
+  relojNotificarDia(dia(E_2024_03_10 + 12 * 3600, GMT_EC, 0), ultimo, alCambiarDia);
+  relojNotificarDia(dia(E_2024_03_10 + 12 * 3600 + 3 * 86400, GMT_EC, 0), ultimo, alCambiarDia);  // re-sync tras corte largo
+  TEST_ASSERT_EQUAL_INT(2, cambiosDia);
+}
+
+void test_cambio_de_offset_cruzando_medianoche_dispara(void) {
+  // 23:30 local; al sumar 1 h de verano pasa a 00:30 del día siguiente
+  int32_t ultimo = -1;
+  uint32_t t = E_2024_03_10 + 4 * 3600 + 30 * 60;
+  relojNotificarDia(dia(t, GMT_EC, 0), ultimo, alCambiarDia);
+  relojNotificarDia(dia(t, GMT_EC, 3600), ultimo, alCambiarDia);
+  TEST_ASSERT_EQUAL_INT(2, cambiosDia);
+  relojNotificarDia(dia(t + 60, GMT_EC, 3600), ultimo, alCambiarDia);
+  TEST_ASSERT_EQUAL_INT(2, cambiosDia);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_epoch_desde_ancla_trunca_segundos);
+  RUN_TEST(test_dia_local_cambia_a_medianoche_local_no_utc);
+  RUN_TEST(test_offset_dst_mueve_el_borde_del_dia);
+  RUN_TEST(test_offset_positivo);
+  RUN_TEST(test_callback_una_vez_por_dia);
+  RUN_TEST(test_sin_hora_no_dispara);
+  RUN_TEST(test_sin_callback_igual_avanza_el_dia);
+  RUN_TEST(test_salto_de_varios_dias_dispara_una_vez);
+  RUN_TEST(test_cambio_de_offset_cruzando_medianoche_dispara);
+  return UNITY_END();
+}
@@ -0,0 +1,176 @@
+// pio test -e native -f test_trace_anillo
+#include <unity.h>
+#include <string.h>
+#include <TraceAnillo.h>
+
+// Flash NOR en RAM: borrar deja 0xFF y escribir solo puede bajar bits
+struct FlashRam {
+  static const uint32_t TAMANO = 4 * TRACE_SECTOR;
+  uint8_t datos[TAMANO];
+  uint32_t borrados = 0;
+
+  uint32_t tamano() const { return TAMANO; }
+  void leer(uint32_t off, void* buf, uint32_t n) const { memcpy(buf, datos + off, n); }
+  bool escribir(uint32_t off, const void* buf, uint32_t n) {
+    const uint8_t* b = (const uint8_t*)buf;
+    for (uint32_t i = 0; i < n; i++) datos[off + i] &= b[i];
+    return true;
+  }
+  void borrar(uint32_t off, uint32_t n) {
+    memset(datos + off, 0xFF, n);
+    borrados++;
+  }
+};
+
+static FlashRam flash;
+static const uint32_t POR_SECTOR = TRACE_SECTOR / sizeof(TraceRegistro);
+
+static void registrar(AnilloTrazas<FlashRam> &a, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t s = a.seq;
+    TEST_ASSERT_TRUE(a.registrar(s * 10, (uint8_t)(s % 6), (uint8_t)(s & 0xFF), s ^ 0xA5A5A5A5));
+  }
+}
+
+// Registra y vuelca todo a flash, como con el equipo ocioso
+static void grabar(AnilloTrazas<FlashRam> &a, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    registrar(a, 1);
+    a.volcar(TRACE_RAM);
+  }
+}
+
+static void verificar(const AnilloTrazas<FlashRam> &a, uint32_t s) {
+  TraceRegistro r;
+  TEST_ASSERT_TRUE(a.leer(s, r));
+  TEST_ASSERT_EQUAL_UINT32(s, r.seq);
+  TEST_ASSERT_EQUAL_UINT32(s * 10, r.t_ms);
+  TEST_ASSERT_EQUAL_UINT8(s % 6, r.tipo);
+  TEST_ASSERT_EQUAL_UINT8(s & 0xFF, r.aux);
+  TEST_ASSERT_EQUAL_UINT32(s ^ 0xA5A5A5A5, r.valor);
+}
+
+void setUp(void) {
+  memset(flash.datos, 0xFF, sizeof(flash.datos));
+  flash.borrados = 0;
+}
+
+void tearDown(void) {}
+
+void test_registro_de_16_bytes(void) {
+  TEST_ASSERT_EQUAL(16, sizeof(TraceRegistro));
+}
+
+void test_flash_virgen_empieza_en_cero(void) {
+  AnilloTrazas<FlashRam> a(flash);
+  a.iniciar();
+  TEST_ASSERT_EQUAL_UINT32(0, a.seq);
+  TEST_ASSERT_EQUAL_UINT32(0, a.offset);
+  TraceRegistro r;
+  TEST_ASSERT_FALSE(a.leer(0, r));
+}
+
+void test_ida_y_vuelta_sin_vuelta_completa(void) {
+  AnilloTrazas<FlashRam> a(flash);
+  a.iniciar();
+  grabar(a, 300);
+  for (uint32_t s = 0; s < 300; s++) verificar(a, s);
+  TraceRegistro r;
+  TEST_ASSERT_FALSE(a.leer(300, r));   // todavía no escrito
+}
+
+void test_ida_y_vuelta_tras_varias_vueltas(void) {
+  AnilloTrazas<FlashRam> a(flash);
+  a.iniciar();
+  uint32_t total = 3 * a.capacidad() + 77;
+  grabar(a, total);
+  TEST_ASSERT_EQUAL_UINT32(total, a.seq);
+  // todo lo garantizado se lee intacto
+  for (uint32_t s = a.seqMasVieja(); s < total; s++) verificar(a, s);
+  // lo anterior al sector recién borrado ya no está
+  TraceRegistro r;
+  TEST_ASSERT_FALSE(a.leer(a.seqMasVieja() - POR_SECTOR - 1, r));
+}
+
+void test_reinicio_recupera_el_cursor(void) {
+  AnilloTrazas<FlashRam> a(flash);
+  a.iniciar();
+  uint32_t total = 2 * a.capacidad() + POR_SECTOR / 2;
+  grabar(a, total);
+
+  AnilloTrazas<FlashRam> b(flash);   // mismo flash tras un reset
+  b.iniciar();
+  TEST_ASSERT_EQUAL_UINT32(a.seq, b.seq);
+  TEST_ASSERT_EQUAL_UINT32(a.offset, b.offset);
+  grabar(b, 10);
+  for (uint32_t s = b.seqMasVieja(); s < b.seq; s++) verificar(b, s);
+}
+
+void test_reinicio_con_sector_justo_lleno(void) {
+  AnilloTrazas<FlashRam> a(flash);
+  a.iniciar();
+  grabar(a, POR_SECTOR);   // cursor en el borde: el próximo registro borra el sector 1
+
+  AnilloTrazas<FlashRam> b(flash);
+  b.iniciar();
+  TEST_ASSERT_EQUAL_UINT32(POR_SECTOR, b.seq);
+  grabar(b, 1);
+  verificar(b, POR_SECTOR);
+  verificar(b, 0);
+}
+
+void test_solo_borra_al_entrar_a_un_sector(void) {
+  AnilloTrazas<FlashRam> a(flash);
+  a.iniciar();
+  grabar(a, 2 * POR_SECTOR + 1);
+  TEST_ASSERT_EQUAL_UINT32(3, flash.borrados);
+}
+
+void test_registrar_no_toca_flash_hasta_volcar(void) {
+  AnilloTrazas<FlashRam> a(flash);
+  a.iniciar();
+  registrar(a, 300);
+  TEST_ASSERT_EQUAL_UINT32(0, flash.borrados);
+  TEST_ASSERT_EQUAL_UINT32(0, a.offset);
+  for (uint32_t s = 0; s < 300; s++) verificar(a, s);   // se leen desde RAM
+
+  TEST_ASSERT_EQUAL_UINT16(100, a.volcar(100));
+  TEST_ASSERT_EQUAL_UINT32(1, flash.borrados);
+  for (uint32_t s = 0; s < 300; s++) verificar(a, s);   // 100 en flash y 200 en RAM
+  TEST_ASSERT_EQUAL_UINT16(200, a.volcar(TRACE_RAM));
+  TEST_ASSERT_EQUAL_UINT16(0, a.ramCount);
+
+  AnilloTrazas<FlashRam> b(flash);   // tras un reset solo queda lo volcado
+  b.iniciar();
+  TEST_ASSERT_EQUAL_UINT32(300, b.seq);
+  for (uint32_t s = 0; s < 300; s++) verificar(b, s);
+}
+
+void test_buffer_lleno_descarta_y_cuenta(void) {
+  AnilloTrazas<FlashRam> a(flash);
+  a.iniciar();
+  registrar(a, TRACE_RAM);
+  TEST_ASSERT_FALSE(a.registrar(0, 0, 0, 0));
+  TEST_ASSERT_FALSE(a.registrar(0, 0, 0, 0));
+  TEST_ASSERT_EQUAL_UINT32(2, a.perdidos);
+  TEST_ASSERT_EQUAL_UINT32(TRACE_RAM, a.seq);   // sin huecos de seq
+
+  a.volcar(10);
+  registrar(a, 10);
+  a.volcar(TRACE_RAM);
+  for (uint32_t s = 0; s < TRACE_RAM + 10; s++) verificar(a, s);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_registro_de_16_bytes);
+  RUN_TEST(test_flash_virgen_empieza_en_cero);
+  RUN_TEST(test_ida_y_vuelta_sin_vuelta_completa);
+  RUN_TEST(test_ida_y_vuelta_tras_varias_vueltas);
+  RUN_TEST(test_reinicio_recupera_el_cursor);
+  RUN_TEST(test_reinicio_con_sector_justo_lleno);
+  RUN_TEST(test_solo_borra_al_entrar_a_un_sector);
+  RUN_TEST(test_registrar_no_toca_flash_hasta_volcar);
+  RUN_TEST(test_buffer_lleno_descarta_y_cuenta);
+  return UNITY_END();
+}
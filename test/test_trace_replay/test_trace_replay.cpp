@@ -0,0 +1,220 @@
+// pio test -e native -f test_trace_replay
+#include <unity.h>
+#include <string.h>
+#include <TraceAnillo.h>
+#include <Dosificacion.h>
+#include <Balanza.h>
+
+static const float FACTOR = 1990000.0;   // default de calibration_factor
+static const float MARGEN_KG = MARGEN_CORTE_DEFECTO_KG;
+static const uint16_t RAM = 64;          // chica: la dosis se vuelca a medias
+
+struct FlashRam {
+  static const uint32_t TAMANO = 4 * TRACE_SECTOR;
+  uint8_t datos[TAMANO];
+
+  uint32_t tamano() const { return TAMANO; }
+  void leer(uint32_t off, void* buf, uint32_t n) const { memcpy(buf, datos + off, n); }
+  bool escribir(uint32_t off, const void* buf, uint32_t n) {
+    const uint8_t* b = (const uint8_t*)buf;
+    for (uint32_t i = 0; i < n; i++) datos[off + i] &= b[i];
+    return true;
+  }
+  void borrar(uint32_t off, uint32_t n) { memset(datos + off, 0xFF, n); }
+};
+
+typedef AnilloTrazas<FlashRam, RAM> Anillo;
+
+static FlashRam flash;
+
+void setUp(void) {
+  memset(flash.datos, 0xFF, sizeof(flash.datos));
+}
+
+void tearDown(void) {}
+
+static uint32_t bits(float v) {
+  uint32_t b;
+  memcpy(&b, &v, sizeof(b));
+  return b;
+}
+
+static float deBits(uint32_t b) {
+  float v;
+  memcpy(&v, &b, sizeof(v));
+  return v;
+}
+
+// Misma conversión que kgDesdeCrudo() sin curva de calibración
+static float kg(int32_t cuentas) {
+  return balanzaKgDesdeCrudo(nullptr, 0, (float)cuentas, FACTOR);
+}
+
+// Tolva simulada como en test_dosificacion, con ruido de la celda en cuentas
+struct Tolva {
+  float caudalAbierta;
+  float latenciaReal;
+  float enVuelo[64];
+  int paso;
+  float enCamara;
+  uint32_t semilla;
+};
+
+static int32_t muestrear(Tolva &t, float apertura) {
+  const int pasosVuelo = (int)(t.latenciaReal / 0.1f + 0.5f);
+  t.enVuelo[t.paso % 64] = t.caudalAbierta * apertura * 0.1f;
+  int llega = t.paso - pasosVuelo;
+  if (llega >= 0) t.enCamara += t.enVuelo[llega % 64];
+  t.paso++;
+  t.semilla = t.semilla * 1103515245u + 12345u;
+  int32_t ruido = (int32_t)((t.semilla >> 16) % 401) - 200;   // ±0.1 g
+  return (int32_t)(t.enCamara * FACTOR) + ruido;
+}
+
+struct Captura {
+  uint32_t desde;          // seq del primer registro de la dosis
+  uint32_t lecturas;
+  float caudalPorApertura;
+};
+
+// Dosis continua con el mismo orden y los mismos registros que dosificarContinuo()
+static Captura capturar(Anillo &a, Tolva &t, float objetivo, float latencia, float caudalPorApertura) {
+  Captura c = {a.seq, 0, 0.0};
+  uint32_t ahora = 5000;
+  uint32_t tPrevio = ahora;
+  DosisContinua d;
+  dosisIniciar(d, objetivo, 0.0);
+  a.registrar(ahora, TR_DOSIS, TRD_OBJETIVO, bits(objetivo));
+  a.registrar(ahora, TR_DOSIS, TRD_LATENCIA, bits(latencia));
+  a.registrar(ahora, TR_DOSIS, TRD_CAUDAL, bits(caudalPorApertura));
+  a.registrar(ahora, TR_DOSIS, TRD_PESO_INICIAL, bits(0.0));
+
+  for (int i = 0; i < 300; i++) {
+    if (dosisDebeCortar(d, latencia, MARGEN_KG)) break;
+    int previo = d.angulo;
+    int angulo = dosisAngulo(d, caudalPorApertura);
+    if (angulo != previo) a.registrar(ahora, TR_SERVO, 1, angulo);
+    ahora += 100 + i % 3;   // el período real del HX711 no es exacto
+    int32_t cuentas = muestrear(t, aperturaPuerta1(angulo));
+    a.registrar(ahora, TR_HX711, TRH_CONTINUO, (uint32_t)cuentas);
+    float dt = (ahora - tPrevio) / 1000.0f;
+    tPrevio = ahora;
+    caudalPorApertura = dosisMedir(d, kg(cuentas), dt, caudalPorApertura, latencia);
+    c.lecturas++;
+    a.volcar(3);
+  }
+  a.registrar(ahora, TR_SERVO, 1, PUERTA1_CERRADA);
+  c.caudalPorApertura = caudalPorApertura;
+  return c;
+}
+
+struct Reproduccion {
+  uint32_t lecturas;          // lecturas TRH_CONTINUO usadas antes del corte
+  uint32_t angulosDistintos;  // pasos donde el ángulo calculado no es el grabado
+  bool cortoAntes;            // el lazo cortó antes de la última lectura grabada
+  bool cortaAlFinal;          // tras la última lectura el lazo decide cortar
+  float caudalPorApertura;
+};
+
+// Pasa las lecturas grabadas por el lazo de lib/Dosificacion. 'latenciaS' < 0
+// usa la latencia grabada; otro valor responde "¿dónde habría cortado con esta?"
+static void reproducir(const Anillo &a, uint32_t desde, float latenciaS, Reproduccion &res) {
+  res = {0, 0, false, false, 0.0};
+  float objetivo = 0.0, pesoInicial = 0.0, latenciaGrabada = 0.0, caudal = 0.0;
+  uint32_t tPrevio = 0;
+  uint32_t s = desde;
+  TraceRegistro r;
+  for (int k = 0; k < 4; k++) {
+    TEST_ASSERT_TRUE(a.leer(s++, r));
+    TEST_ASSERT_EQUAL_UINT8(TR_DOSIS, r.tipo);
+    float v = deBits(r.valor);
+    if (r.aux == TRD_OBJETIVO) objetivo = v;
+    if (r.aux == TRD_LATENCIA) latenciaGrabada = v;
+    if (r.aux == TRD_CAUDAL) caudal = v;
+    if (r.aux == TRD_PESO_INICIAL) { pesoInicial = v; tPrevio = r.t_ms; }
+  }
+  // el aprendizaje del caudal usa la grabada, como en el equipo
+  float latencia = latenciaS >= 0 ? latenciaS : latenciaGrabada;
+
+  DosisContinua d;
+  dosisIniciar(d, objetivo, pesoInicial);
+  int servo = PUERTA1_CERRADA;
+  while (a.leer(s++, r)) {
+    if (r.tipo == TR_SERVO) { servo = (int)r.valor; continue; }
+    if (r.tipo != TR_HX711 || r.aux != TRH_CONTINUO) continue;
+    // antes de esta lectura el equipo decidió seguir y movió la puerta
+    if (dosisDebeCortar(d, latencia, MARGEN_KG)) { res.cortoAntes = true; break; }
+    if (dosisAngulo(d, caudal) != servo) res.angulosDistintos++;
+    float dt = (r.t_ms - tPrevio) / 1000.0f;
+    tPrevio = r.t_ms;
+    caudal = dosisMedir(d, kg((int32_t)r.valor), dt, caudal, latenciaGrabada);
+    res.lecturas++;
+  }
+  if (!res.cortoAntes) res.cortaAlFinal = dosisDebeCortar(d, latencia, MARGEN_KG);
+  res.caudalPorApertura = caudal;
+}
+
+static Tolva tolvaTipica() {
+  Tolva t = {};
+  t.caudalAbierta = 0.05f;
+  t.latenciaReal = 0.6f;
+  t.semilla = 7;
+  return t;
+}
+
+void test_reproduce_la_dosis_grabada(void) {
+  Anillo a(flash);
+  a.iniciar();
+  Tolva t = tolvaTipica();
+  Captura c = capturar(a, t, 0.100f, 0.4f, 0.03f);
+  TEST_ASSERT_TRUE(c.lecturas > 20);
+  TEST_ASSERT_TRUE(a.ramCount > 0);   // parte en flash, parte en RAM
+
+  Reproduccion r;
+  reproducir(a, c.desde, -1.0f, r);
+  TEST_ASSERT_EQUAL_UINT32(c.lecturas, r.lecturas);
+  TEST_ASSERT_EQUAL_UINT32(0, r.angulosDistintos);
+  TEST_ASSERT_FALSE(r.cortoAntes);
+  TEST_ASSERT_TRUE(r.cortaAlFinal);
+  TEST_ASSERT_EQUAL_FLOAT(c.caudalPorApertura, r.caudalPorApertura);
+}
+
+void test_reproduce_tras_volcar_y_reiniciar(void) {
+  Anillo a(flash);
+  a.iniciar();
+  Tolva t = tolvaTipica();
+  capturar(a, t, 0.050f, 0.4f, 0.03f);   // dosis anterior en el anillo
+  t = tolvaTipica();
+  Captura c = capturar(a, t, 0.100f, 0.45f, 0.04f);
+  a.volcar(RAM);
+
+  Anillo b(flash);   // lo que queda en flash tras un reset
+  b.iniciar();
+  TEST_ASSERT_EQUAL_UINT32(a.seq, b.seq);
+  Reproduccion r;
+  reproducir(b, c.desde, -1.0f, r);
+  TEST_ASSERT_EQUAL_UINT32(c.lecturas, r.lecturas);
+  TEST_ASSERT_EQUAL_UINT32(0, r.angulosDistintos);
+  TEST_ASSERT_TRUE(r.cortaAlFinal);
+}
+
+void test_con_la_latencia_real_habria_cortado_antes(void) {
+  Anillo a(flash);
+  a.iniciar();
+  Tolva t = tolvaTipica();
+  Captura c = capturar(a, t, 0.100f, 0.4f, 0.03f);   // latencia aprendida corta
+
+  Reproduccion r;
+  reproducir(a, c.desde, t.latenciaReal, r);
+  TEST_ASSERT_TRUE(r.cortoAntes);
+  TEST_ASSERT_TRUE(r.lecturas < c.lecturas);
+  TEST_ASSERT_EQUAL_UINT32(0, r.angulosDistintos);   // la latencia solo mueve el corte
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_reproduce_la_dosis_grabada);
+  RUN_TEST(test_reproduce_tras_volcar_y_reiniciar);
+  RUN_TEST(test_con_la_latencia_real_habria_cortado_antes);
+  return UNITY_END();
+}